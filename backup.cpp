@@ -2,36 +2,64 @@
 #define _POSIX_C_SOURCE 200112L
 #define _FILE_OFFSET_BITS 64
 
-#ifdef _WIN32
-// lseek
-#include <io.h>
-#endif
+#include <algorithm>
+#include <deque>
+#include <future>
+
+#include "boost/asio/post.hpp"
+#include "boost/asio/thread_pool.hpp"
 
 #include "backup.h"
+#include "catalog.h"
+#include "filter.h"
 
-std::vector<int64_t> resolveBlockList(std::vector<int64_t> thisList, std::vector<int64_t> previousList) {
-	std::vector<int64_t> resultList;
+void resolveBlockListInto(BlockListView thisList, BlockListView previousList, BlockList &result) {
+	result.clear();
 
-	for (int i = 0; i < thisList.size(); ) {
+	for (size_t i = 0; i < thisList.size(); ) {
 		int64_t thisBlock = thisList[i++];
 
 		if (thisBlock < 0) {
-			int runStartIndex = (int) -(thisBlock + 1);
-			int runLength = (int) thisList[i++];
+			if (i >= thisList.size()) {
+				throw std::runtime_error("Block list ends in the middle of a back-reference");
+			}
 
-			// Copy a run of block indexes from the previous revision's list of blocks
-			for (int j = 0; j < runLength; j++) {
-				resultList.push_back(previousList[runStartIndex + j]);
+			uint64_t runStartIndex = (uint64_t) -(thisBlock + 1);
+			int64_t runLength = thisList[i++];
+
+			if (runLength < 0 || runStartIndex > previousList.size() || (uint64_t) runLength > previousList.size() - runStartIndex) {
+				throw std::runtime_error("Block list back-reference lies outside the previous revision's blocks");
 			}
+
+			// Copy a run of block indexes from the previous revision's list of blocks
+			result.insert(result.end(), previousList.begin() + runStartIndex, previousList.begin() + runStartIndex + runLength);
 		} else {
-			resultList.push_back(thisBlock);
+			result.push_back(thisBlock);
 		}
 	}
+}
+
+BlockList resolveBlockList(BlockListView thisList, BlockListView previousList) {
+	BlockList result;
+
+	resolveBlockListInto(thisList, previousList, result);
+
+	return result;
+}
 
-	return resultList;
+static bool hasBackReferences(BlockListView list) {
+	return std::any_of(list.begin(), list.end(), [](int64_t block) {
+		return block < 0;
+	});
 }
 
-BackupArchive::BackupArchive(const boost::filesystem::path &path, const std::string &key) : rootPath(path), blockDirectories(path), key(key) {
+// fileId, parentFileId, fileType, SourceFileVersion, fileHistoryPosition, fileHistoryLength, encPathLen:
+const int FILE_MANIFEST_RECORD_HEADER_LEN = 16 + 16 + 1 + 41 + 8 + 4 + 2;
+
+const uint32_t FILE_MANIFEST_OFFSETS_CACHE_FORMAT = 1;
+
+BackupArchive::BackupArchive(const boost::filesystem::path &path, const std::string &key) :
+	rootPath(path), hasFileManifestOffsets(false), usePathCatalog(false), blockDirectories(path), key(key) {
 	fileManifestFilename = (path / boost::filesystem::path("cpfmf")).string();
 	fileHistoryFilename = (path/ boost::filesystem::path("cphdf")).string();
 
@@ -58,25 +86,90 @@ void BackupArchive::cacheBlockIndex() {
 	blockDirectories.cacheIndex();
 }
 
-void readFileManifestHeader(FILE *file, FileManifestHeader &header) {
-	readBytes(header.fileId, file, sizeof(header.fileId));
-	readBytes(header.parentFileId, file, sizeof(header.parentFileId));
-	header.fileType = readUInt8(file);
+void BackupArchive::setIndexCacheDirectory(const boost::filesystem::path &cacheRoot) {
+	boost::filesystem::path archivePath = boost::filesystem::canonical(rootPath);
+	std::string archivePathString = archivePath.string();
+
+	/* Archives are named after the computer's GUID, which is repeated in every destination that backs up that computer
+	 * (and by copies of the archive), so the directory is told apart by a hash of the archive's full path too:
+	 */
+	CryptoPP::Weak::MD5 hasher;
+	CryptoPP::byte pathHash[CryptoPP::Weak::MD5::DIGESTSIZE];
+
+	hasher.Update((const CryptoPP::byte *) archivePathString.data(), archivePathString.length());
+	hasher.Final(pathHash);
+
+	indexCache = IndexCache(cacheRoot / (archivePath.filename().string() + "-" + binStringToHex(std::string((const char *) pathHash, 8))));
+
+	blockDirectories.setIndexCache(indexCache);
+}
+
+void BackupArchive::scanFileManifestOffsets() {
+	FileManifestReader reader(fileManifestFilename);
+	FileManifestHeader header;
+	boost::string_view encryptedPath;
+
+	fileManifestOffsets.clear();
+
+	for (uint64_t offset = reader.tell(); reader.next(header, encryptedPath); offset = reader.tell()) {
+		fileManifestOffsets.push_back(offset);
+	}
+}
+
+const std::vector<int64_t>& BackupArchive::getFileManifestOffsets() {
+	if (hasFileManifestOffsets) {
+		return fileManifestOffsets;
+	}
+
+	std::vector<boost::filesystem::path> sources = {boost::filesystem::path(fileManifestFilename)};
+	FILE *cacheFile = indexCache.openForReading("cpfmf", FILE_MANIFEST_OFFSETS_CACHE_FORMAT, sources);
+	uint64_t count;
+
+	if (cacheFile && readCacheValue(cacheFile, count) && readCacheArray(cacheFile, fileManifestOffsets, count)) {
+		fclose(cacheFile);
+	} else {
+		if (cacheFile) {
+			fclose(cacheFile);
+		}
+
+		scanFileManifestOffsets();
+
+		indexCache.write("cpfmf", FILE_MANIFEST_OFFSETS_CACHE_FORMAT, sources, [this](FILE *file) {
+			return writeCacheValue(file, fileManifestOffsets.size()) && writeCacheArray(file, fileManifestOffsets);
+		});
+	}
+
+	hasFileManifestOffsets = true;
+
+	return fileManifestOffsets;
+}
+
+bool FileManifestReader::next(FileManifestHeader &header, boost::string_view &encryptedPath) {
+	if (position + FILE_MANIFEST_RECORD_HEADER_LEN > manifest->size()) {
+		return false;
+	}
 
-	header.version.readFrom(file);
+	uint8_t *cursor = (uint8_t *) manifest->view(position, FILE_MANIFEST_RECORD_HEADER_LEN).data();
 
-	header.fileHistoryPosition = readInt64BE(file);
-	header.fileHistoryLength = readInt32BE(file);
-	header.encPathLen = readInt16BE(file);
+	header.readFrom(cursor);
 
-	// If we've already slammed into the end of the file then encPathLen is garbage, don't use it
-	if (!feof(file)) {
-		header.path.resize(header.encPathLen);
-		readBytes((uint8_t *) &header.path[0], file, header.encPathLen);
+	if (header.encPathLen < 0) {
+		throw std::runtime_error("Bad path length in file manifest at offset " + std::to_string(position));
 	}
+
+	uint64_t pathStart = position + FILE_MANIFEST_RECORD_HEADER_LEN;
+
+	if (pathStart + header.encPathLen > manifest->size()) {
+		return false;
+	}
+
+	encryptedPath = manifest->view(pathStart, header.encPathLen);
+	position = pathStart + header.encPathLen;
+
+	return true;
 }
 
-std::string decryptEncryptedPath(std::string path, const std::string &key) {
+std::string decryptEncryptedPath(boost::string_view path, const std::string &key) {
 	const int MODERN_HEADER_LEN = 6;
 	
 	if (path.length() >= MODERN_HEADER_LEN) {
@@ -92,46 +185,192 @@ std::string decryptEncryptedPath(std::string path, const std::string &key) {
 			if (encryption < CIPHER_CODE_MIN || encryption > CIPHER_CODE_MAX) {
 				throw std::runtime_error("Unsupported filename cipher " + std::to_string(encryption));
 			} else {
-				return code42Ciphers[encryption]->decrypt(path, key);
+				return code42Ciphers[encryption]->decrypt((const uint8_t *) path.data(), path.length(), key);
 			}
 		}
 	}
 	
 	// Assume this the older headerless format that just hard-coded the use of Blowfish-128
-	return code42Ciphers[CIPHER_CODE_BLOWFISH_128]->decrypt(path, key);
+	return code42Ciphers[CIPHER_CODE_BLOWFISH_128]->decrypt((const uint8_t *) path.data(), path.length(), key);
 }
 
-BackupArchive::iterator BackupArchive::begin(FilenameMatchMode matchMode, const std::string &search) {
-	return BackupArchive::iterator(fileManifestFilename, key, matchMode, search);
+bool filenameMatches(const std::string &path, FilenameMatchMode matchMode, const std::string &search) {
+	switch (matchMode) {
+		case FilenameMatchMode::prefix:
+			return path.find(search) == 0;
+		case FilenameMatchMode::equals:
+			return path == search;
+		default:
+			return true;
+	}
 }
 
-BackupArchive::iterator BackupArchive::end() {
-	return BackupArchive::iterator(fileManifestFilename);
-}
+void BackupArchive::forEachFile(FilenameMatchMode matchMode, const std::string &search, const PathFilter *filter, int jobs, bool loadHistories,
+								const std::function<void(FileManifestHeader &file, FileHistory *history, FileBatchOutput &result)> &process,
+								const std::function<void(const FileBatchOutput &result)> &emit) {
+	const size_t BATCH_RECORDS = 1024;
+
+	const std::vector<int64_t> &offsets = getFileManifestOffsets();
+	std::shared_ptr<const MappedFile> manifest = FileManifestReader(fileManifestFilename).getMapping();
+
+	// If the catalog can find the matching files for us, only those need to be visited, and their paths are known:
+	std::vector<FileManifestLocation> locations;
+	bool useLocations = findInPathCatalog(matchMode, search, locations);
+
+	size_t fileCount = useLocations ? locations.size() : offsets.size();
+	size_t batchCount = (fileCount + BATCH_RECORDS - 1) / BATCH_RECORDS;
+
+	// Limit how many batches can be finished but waiting for an earlier batch to be emitted
+	size_t maxBatchesInFlight = (size_t) std::max(jobs, 1) * 4;
+
+	boost::asio::thread_pool pool(std::max(jobs, 1));
+	std::deque<std::future<FileBatchOutput>> inFlight;
+	size_t nextBatch = 0;
+
+	try {
+		for (size_t batch = 0; batch < batchCount; batch++) {
+			while (nextBatch < batchCount && nextBatch < batch + maxBatchesInFlight) {
+				auto task = std::make_shared<std::packaged_task<FileBatchOutput()>>(
+					[this, &offsets, &locations, useLocations, manifest, nextBatch, BATCH_RECORDS, fileCount, matchMode, &search, filter, loadHistories, &process]() {
+						FileBatchOutput result;
+						FileManifestReader reader(manifest);
+						FileManifestHeader file;
+						boost::string_view encryptedPath;
+
+						// Files are only processed once their histories have been loaded along with the rest of the batch's:
+						std::vector<FileManifestHeader> matched;
+
+						auto addMatch = [loadHistories, &process, &file, &matched, &result]() {
+							if (loadHistories) {
+								matched.push_back(file);
+							} else {
+								process(file, nullptr, result);
+							}
+						};
+
+						size_t first = nextBatch * BATCH_RECORDS;
+						size_t last = std::min(first + BATCH_RECORDS, fileCount);
+
+						if (useLocations) {
+							for (size_t i = first; i < last; i++) {
+								reader.seek(locations[i].offset);
+
+								if (!reader.next(file, encryptedPath)) {
+									throw std::runtime_error("Failed to read file manifest record at offset " + std::to_string(locations[i].offset));
+								}
+
+								file.path = locations[i].path;
+
+								if (!filter || filter->matches(file.path)) {
+									addMatch();
+								}
+							}
+						} else {
+							reader.seek(offsets[first]);
+
+							for (size_t i = first; i < last && reader.next(file, encryptedPath); i++) {
+								try {
+									file.path = decryptEncryptedPath(encryptedPath, key);
+								} catch (const std::exception &e) {
+									throw std::runtime_error("Failed to decrypt path for file at offset " + std::to_string(offsets[i]) + ": " + e.what());
+								}
+
+								if (filenameMatches(file.path, matchMode, search) && (!filter || filter->matches(file.path))) {
+									addMatch();
+								}
+							}
+						}
+
+						if (!matched.empty()) {
+							FileHistoryBatch histories(*this);
+
+							for (auto &matchedFile : matched) {
+								if (matchedFile.hasHistory()) {
+									histories.add(matchedFile);
+								}
+							}
+
+							histories.fetch();
+
+							size_t historyIndex = 0;
+
+							for (auto &matchedFile : matched) {
+								process(matchedFile, matchedFile.hasHistory() ? &histories.get(historyIndex++) : nullptr, result);
+							}
+						}
+
+						return result;
+					}
+				);
+
+				inFlight.push_back(task->get_future());
+				boost::asio::post(pool, [task]() {
+					(*task)();
+				});
+
+				nextBatch++;
+			}
 
-FileHistory BackupArchive::getFileHistory(const FileManifestHeader &manifest) {
-	FileHistory result;
+			FileBatchOutput result = inFlight.front().get();
+			inFlight.pop_front();
 
-	lseek(fileHistoryHandle, manifest.fileHistoryPosition, SEEK_SET);
+			emit(result);
+		}
+	} catch (...) {
+		// Let the workers finish up before their captures go out of scope
+		pool.join();
+		throw;
+	}
 
-	// Read the whole compressed history into a buffer:
-	size_t bytesToRead = manifest.fileHistoryLength;
-	std::string compressedHistory(bytesToRead, '\0');
+	pool.join();
+}
 
-	while (bytesToRead > 0) {
-		ssize_t bytesRead = read(fileHistoryHandle, &compressedHistory[0], bytesToRead);
+bool BackupArchive::findInPathCatalog(FilenameMatchMode matchMode, const std::string &search, std::vector<FileManifestLocation> &locations) {
+	// Without a filter every path has to be visited anyway, so the catalog wouldn't help
+	if (!usePathCatalog || matchMode == FilenameMatchMode::none || !indexCache.isEnabled()) {
+		return false;
+	}
 
-		if (bytesRead >= 0) {
-			bytesToRead -= bytesRead;
+	if (!pathCatalog) {
+		pathCatalog = PathCatalog::open(indexCache, fileManifestFilename, key, getFileManifestOffsets());
 
-			if (bytesRead == 0 && bytesToRead > 0) {
-				throw std::runtime_error("Unexpected end of file when reading file history");
-			}
+		if (!pathCatalog) {
+			usePathCatalog = false;
+			return false;
 		}
 	}
 
+	locations = pathCatalog->find(matchMode, search);
+
+	return true;
+}
+
+BackupArchive::iterator BackupArchive::begin(FilenameMatchMode matchMode, const std::string &search, const PathFilter *filter) {
+	std::vector<FileManifestLocation> locations;
+
+	if (findInPathCatalog(matchMode, search, locations)) {
+		return BackupArchive::iterator(fileManifestFilename, std::make_shared<const std::vector<FileManifestLocation>>(std::move(locations)), filter);
+	}
+
+	return BackupArchive::iterator(fileManifestFilename, key, matchMode, search, filter);
+}
+
+BackupArchive::iterator BackupArchive::end() {
+	return BackupArchive::iterator(fileManifestFilename);
+}
+
+/**
+ * Decode a file's history record (as stored in the file history) into result, reusing its storage, and check that it
+ * belongs to the given file ID.
+ */
+static void decodeFileHistory(const CryptoPP::byte *fileId, boost::string_view compressedHistory, FileHistory &result) {
+	static thread_local Inflater inflater;
+	static thread_local std::string historyBuffer;
+
+	result.clear();
+
 	// History may or may not be compressed (gzip/zlib), auto-detect that and decompress it if needed:
-	std::string historyBuffer = maybeDecompress(compressedHistory);
+	inflater.inflate(compressedHistory, historyBuffer);
 
 	// Now we can use these cursors to walk the uncompressed history data:
 	uint8_t *historyCursor = (uint8_t *) historyBuffer.data();
@@ -158,80 +397,260 @@ FileHistory BackupArchive::getFileHistory(const FileManifestHeader &manifest) {
 		readBytes(result.manifestChecksum, historyCursor, sizeof(result.manifestChecksum));
 	}
 
-	if (memcmp(result.fileId, manifest.fileId, sizeof(manifest.fileId)) != 0) {
+	if (memcmp(result.fileId, fileId, sizeof(result.fileId)) != 0) {
 		throw std::runtime_error("Bad revision history pointer for file, can't fetch revisions");
 	}
 
 	while (historyCursor < historyEnd) {
-		ArchivedFileVersion fileVersion;
+		result.versions.emplace_back();
+		result.versions.back().readFrom(historyCursor, dataVersion, result.blockInfo);
+	}
+}
+
+std::vector<FileHistoryLocation> BackupArchive::getFileHistoryLocations() const {
+	FileManifestReader reader(fileManifestFilename);
+	FileManifestHeader header;
+	boost::string_view encryptedPath;
 
-		fileVersion.readFrom(historyCursor, dataVersion);
+	std::vector<FileHistoryLocation> locations;
 
-		result.versions.push_back(fileVersion);
+	while (reader.next(header, encryptedPath)) {
+		if (header.hasHistory()) {
+			locations.emplace_back(header);
+		}
 	}
 
+	return locations;
+}
+
+FileHistory BackupArchive::getFileHistory(const FileManifestHeader &manifest) const {
+	FileHistory result;
+
+	getFileHistory(manifest, result);
+
 	return result;
 }
 
+void BackupArchive::getFileHistory(const FileManifestHeader &manifest, FileHistory &result) const {
+	static thread_local std::string compressedHistory;
+
+	// Read the whole compressed history into a buffer:
+	compressedHistory.resize(manifest.fileHistoryLength);
+
+	if (readFileAt(fileHistoryHandle, &compressedHistory[0], compressedHistory.length(), manifest.fileHistoryPosition) != compressedHistory.length()) {
+		throw std::runtime_error("Unexpected end of file when reading file history");
+	}
+
+	decodeFileHistory(manifest.fileId, compressedHistory, result);
+}
+
+size_t FileHistoryBatch::add(const FileHistoryLocation &location) {
+	// Entries left over from before a clear() are reused, along with their histories' storage:
+	if (entryCount == entries.size()) {
+		entries.emplace_back();
+	}
+
+	Entry &entry = entries[entryCount];
+
+	entry.location = location;
+	entry.loaded = false;
+	entry.error.clear();
+
+	return entryCount++;
+}
+
+void FileHistoryBatch::fetch() {
+	// Records this close together are fetched with one read, along with the unused bytes between them:
+	const int64_t MAX_READ_GAP = 64 * 1024;
+	const int64_t MAX_READ_LENGTH = 8 * 1024 * 1024;
+
+	std::vector<size_t> readOrder;
+
+	for (size_t i = 0; i < entryCount; i++) {
+		if (!entries[i].loaded) {
+			readOrder.push_back(i);
+		}
+	}
+
+	std::sort(readOrder.begin(), readOrder.end(), [this](size_t a, size_t b) {
+		return entries[a].location.position < entries[b].location.position;
+	});
+
+	std::string buffer;
+
+	for (size_t first = 0; first < readOrder.size(); ) {
+		int64_t readStart = entries[readOrder[first]].location.position;
+		int64_t readEnd = readStart + entries[readOrder[first]].location.length;
+		size_t last = first + 1;
+
+		for (; last < readOrder.size(); last++) {
+			const Entry &next = entries[readOrder[last]];
+			int64_t nextEnd = std::max(readEnd, next.location.position + next.location.length);
+
+			if (next.location.position - readEnd > MAX_READ_GAP || nextEnd - readStart > MAX_READ_LENGTH) {
+				break;
+			}
+
+			readEnd = nextEnd;
+		}
+
+		size_t bytesRead = 0;
+		std::string readError;
+
+		buffer.resize(readEnd - readStart);
+
+		try {
+			bytesRead = readFileAt(archive.fileHistoryHandle, &buffer[0], buffer.length(), readStart);
+		} catch (std::exception &e) {
+			readError = e.what();
+		}
+
+		for (size_t i = first; i < last; i++) {
+			Entry &entry = entries[readOrder[i]];
+			int64_t start = entry.location.position - readStart;
+
+			entry.loaded = true;
+
+			if (!readError.empty()) {
+				entry.error = readError;
+			} else if (start + entry.location.length > (int64_t) bytesRead) {
+				entry.error = "Unexpected end of file when reading file history";
+			} else {
+				try {
+					decodeFileHistory(entry.location.fileId, boost::string_view(buffer.data() + start, entry.location.length), entry.history);
+				} catch (std::exception &e) {
+					entry.error = e.what();
+				}
+			}
+		}
+
+		first = last;
+	}
+}
+
+FileHistory& FileHistoryBatch::get(size_t index) {
+	if (index >= entryCount || !entries[index].loaded) {
+		throw std::runtime_error("File history was not fetched as part of this batch");
+	}
+
+	Entry &entry = entries[index];
+
+	if (!entry.error.empty()) {
+		throw std::runtime_error(entry.error);
+	}
+
+	return entry.history;
+}
+
+void FileHistoryBatch::clear() {
+	entryCount = 0;
+}
+
 BackupArchiveFileIterator::BackupArchiveFileIterator(const std::string &manifestFilename) :
 	fileManifestFilename(manifestFilename),
-	isEnd(true)
+	isEnd(true),
+	currentOffset(0),
+	matchMode(FilenameMatchMode::none),
+	filter(nullptr),
+	locationIndex(0)
 {
 }
 
 BackupArchiveFileIterator::BackupArchiveFileIterator(const std::string &manifestFilename,
-						  const std::string &key, FilenameMatchMode matchMode, const std::string &search) :
+						  const std::string &key, FilenameMatchMode matchMode, const std::string &search, const PathFilter *filter) :
 		fileManifestFilename(manifestFilename),
+		manifestReader(new FileManifestReader(manifestFilename)),
 		isEnd(false),
+		currentOffset(0),
 		key(key),
-		matchMode(matchMode), search(search) {
-
-	openFileManifest();
+		matchMode(matchMode), search(search), filter(filter),
+		locationIndex(0) {
 
 	// Advance to the first file
 	findNextFile();
 }
 
+BackupArchiveFileIterator::BackupArchiveFileIterator(const std::string &manifestFilename,
+						  std::shared_ptr<const std::vector<FileManifestLocation>> locations, const PathFilter *filter) :
+		fileManifestFilename(manifestFilename),
+		manifestReader(new FileManifestReader(manifestFilename)),
+		isEnd(false),
+		currentOffset(0),
+		matchMode(FilenameMatchMode::none), filter(filter),
+		locations(std::move(locations)), locationIndex(0) {
+
+	findNextFile();
+}
+
 void BackupArchiveFileIterator::findNextFile() {
-	if (!isEnd) {
-		bool found;
+	if (isEnd) {
+		return;
+	}
 
-		do {
-		    off_t start = ftello(manifestFile);
-		    
-			readFileManifestHeader(manifestFile, currentFile);
+	boost::string_view encryptedPath;
 
-			if (feof(manifestFile)) {
+	while (true) {
+		if (locations) {
+			if (locationIndex >= locations->size()) {
 				isEnd = true;
-				fclose(manifestFile);
-				break;
+				return;
+			}
+
+			const FileManifestLocation &location = (*locations)[locationIndex++];
+
+			manifestReader->seek(location.offset);
+
+			if (!manifestReader->next(currentFile, encryptedPath)) {
+				throw std::runtime_error("Failed to read file manifest record at offset " + std::to_string(location.offset));
+			}
+
+			currentOffset = location.offset;
+			currentFile.path.assign(location.path);
+		} else {
+			currentOffset = manifestReader->tell();
+
+			if (!manifestReader->next(currentFile, encryptedPath)) {
+				isEnd = true;
+				return;
 			}
-			
+
 			try {
-                currentFile.path = decryptEncryptedPath(currentFile.path, key);
-            } catch (const std::exception &e) {
-			    std::cerr << "Failed to decrypt path for file at offset " << std::to_string(start) << std::endl;
-			    throw;
+				currentFile.path = decryptEncryptedPath(encryptedPath, key);
+			} catch (const std::exception &e) {
+				std::cerr << "Failed to decrypt path for file at offset " << std::to_string(currentOffset) << std::endl;
+				throw;
 			}
 
 			// Does this path meet our search conditions?
-			switch (matchMode) {
-				case FilenameMatchMode::none:
-					found = true;
-					break;
-				case FilenameMatchMode::prefix:
-					found = currentFile.path.find(search) == 0;
-					break;
-				case FilenameMatchMode::equals:
-					found = currentFile.path == search;
-					break;
+			if (!filenameMatches(currentFile.path, matchMode, search)) {
+				continue;
 			}
-		} while (!found);
+		}
+
+		if (!filter || filter->matches(currentFile.path)) {
+			return;
+		}
 	}
 }
 
-FileManifestHeader BackupArchiveFileIterator::operator*() {
-	return currentFile;
+void BackupArchiveFileIterator::seek(uint64_t offset) {
+	if (!manifestReader) {
+		throw std::runtime_error("Can't seek the end iterator of the file manifest");
+	}
+
+	isEnd = false;
+
+	if (locations) {
+		locationIndex = std::lower_bound(locations->begin(), locations->end(), offset,
+			[](const FileManifestLocation &location, uint64_t offset) {
+				return (uint64_t) location.offset < offset;
+			}
+		) - locations->begin();
+	} else {
+		manifestReader->seek(offset);
+	}
+
+	findNextFile();
 }
 
 bool BackupArchiveFileIterator::operator==(const BackupArchiveFileIterator &that) const {
@@ -247,7 +666,7 @@ bool BackupArchiveFileIterator::operator==(const BackupArchiveFileIterator &that
 		return true;
 	}
 
-	return ftello(manifestFile) == ftello(that.manifestFile);
+	return currentOffset == that.currentOffset;
 }
 
 bool BackupArchiveFileIterator::operator!=(const BackupArchiveFileIterator &that) const {
@@ -260,65 +679,39 @@ BackupArchiveFileIterator &BackupArchiveFileIterator::operator++() {
 	return *this;
 }
 
-BackupArchiveFileIterator BackupArchiveFileIterator::operator++(int) {
-	BackupArchiveFileIterator temp(*this);
-
-	++*this;
+int FileHistory::findVersionAt(int64_t timestamp) const {
+	auto after = std::upper_bound(versions.begin(), versions.end(), timestamp, [](int64_t timestamp, const ArchivedFileVersion &version) {
+		return timestamp < version.timestamp;
+	});
 
-	return temp;
+	return (int) (after - versions.begin()) - 1;
 }
 
-void BackupArchiveFileIterator::openFileManifest() {
-	if (!isEnd) {
-		manifestFile = fopen(fileManifestFilename.c_str(), "rb");
+void FileHistory::resolveBlockList(int index, BlockList &result) const {
+	// Start from the nearest version whose list doesn't refer back to the ones before it:
+	int first = index;
 
-		if (!manifestFile) {
-			throw std::runtime_error(
-				"Failed to open archive file manifest " + fileManifestFilename);
-		}
+	while (first > 0 && hasBackReferences(getBlockInfo(versions[first]))) {
+		first--;
 	}
-}
-
-BackupArchiveFileIterator::BackupArchiveFileIterator(const BackupArchiveFileIterator & that) :
-		fileManifestFilename(that.fileManifestFilename),
-		isEnd(that.isEnd),
-		key(that.key),
-		matchMode(that.matchMode), search(that.search) {
 
-	openFileManifest();
+	// (The first version's back-references, if it has any, are resolved against its own list)
+	resolveBlockListInto(getBlockInfo(versions[first]), getBlockInfo(versions[first]), result);
 
-	// Doesn't advance the pointer
-}
+	BlockList previous;
 
-BackupArchiveFileIterator &BackupArchiveFileIterator::operator=(const BackupArchiveFileIterator &that) {
-	if (!isEnd) {
-		fclose(manifestFile);
+	for (int i = first + 1; i <= index; i++) {
+		std::swap(result, previous);
+		resolveBlockListInto(getBlockInfo(versions[i]), previous, result);
 	}
-
-	fileManifestFilename = that.fileManifestFilename;
-	isEnd = that.isEnd;
-
-	openFileManifest();
-
-	currentFile = that.currentFile;
-
-	key = that.key;
-	matchMode = that.matchMode;
-	search = that.search;
-
-	return *this;
 }
 
-BackupArchiveFileIterator::~BackupArchiveFileIterator() {
-	if (!isEnd) {
-		fclose(manifestFile);
-	}
-}
+FileHistoryIterator::FileHistoryIterator(const FileHistory *history, bool end) : history(history), index(end ? history->versions.size() : 0) {
+	snapshot.version = nullptr;
 
-FileHistoryIterator::FileHistoryIterator(std::vector<ArchivedFileVersion> *versions, bool end) : versions(versions), index(end ? versions->size() : 0) {
-	if (index == 0 && !versions->empty()) {
-		snapshot.version = (*versions)[0];
-		snapshot.blockList = resolveBlockList(snapshot.version.blockInfo, snapshot.version.blockInfo);
+	if (index == 0 && !history->versions.empty()) {
+		snapshot.version = &history->versions[0];
+		resolveBlockListInto(history->getBlockInfo(*snapshot.version), history->getBlockInfo(*snapshot.version), snapshot.blockList);
 	}
 }
 
@@ -341,10 +734,11 @@ bool FileHistoryIterator::operator!=(const FileHistoryIterator &that) const {
 FileHistoryIterator &FileHistoryIterator::operator++() {
 	index++;
 
-	if (index < versions->size()) {
-		snapshot.version = (*versions)[index];
+	if (index < (int) history->versions.size()) {
+		snapshot.version = &history->versions[index];
 		// Resolve backreferences in the list of block numbers using the previous revision we pointed to:
-		snapshot.blockList = resolveBlockList(snapshot.version.blockInfo, snapshot.blockList);
+		std::swap(snapshot.blockList, previousBlockList);
+		resolveBlockListInto(history->getBlockInfo(*snapshot.version), previousBlockList, snapshot.blockList);
 	}
 
 	return *this;
@@ -359,13 +753,13 @@ FileHistoryIterator FileHistoryIterator::operator++(int) {
 }
 
 FileHistoryIterator::FileHistoryIterator(const FileHistoryIterator & that) :
-	versions(that.versions),
+	history(that.history),
 	index(that.index),
 	snapshot(that.snapshot) {
 }
 
 FileHistoryIterator &FileHistoryIterator::operator=(const FileHistoryIterator &that) {
-	versions = that.versions;
+	history = that.history;
 	index = that.index;
 	snapshot = that.snapshot;
 
@@ -1,5 +1,8 @@
 #pragma once
 
+#include <cstring>
+#include <functional>
+#include <memory>
 #include <vector>
 #include <utility>
 
@@ -42,7 +45,51 @@
 
 typedef std::vector<int64_t> BlockList;
 
-BlockList resolveBlockList(BlockList thisList, BlockList previousList);
+/**
+ * A read-only view of a list of block numbers stored elsewhere (e.g. in a FileHistory or a BlockList).
+ */
+class BlockListView {
+private:
+	const int64_t *first;
+	size_t length;
+
+public:
+	BlockListView() : first(nullptr), length(0) {
+	}
+
+	BlockListView(const int64_t *first, size_t length) : first(first), length(length) {
+	}
+
+	BlockListView(const BlockList &list) : first(list.data()), length(list.size()) {
+	}
+
+	const int64_t* begin() const {
+		return first;
+	}
+
+	const int64_t* end() const {
+		return first + length;
+	}
+
+	size_t size() const {
+		return length;
+	}
+
+	bool empty() const {
+		return length == 0;
+	}
+
+	int64_t operator[](size_t index) const {
+		return first[index];
+	}
+};
+
+/**
+ * Resolve the back-references in a revision's list of blocks, which refer to runs of the previous revision's resolved
+ * list, into result (reusing its storage). The result must not be one of the inputs.
+ */
+void resolveBlockListInto(BlockListView thisList, BlockListView previousList, BlockList &result);
+BlockList resolveBlockList(BlockListView thisList, BlockListView previousList);
 
 class SourceFileVersion {
 public:
@@ -97,10 +144,17 @@ public:
 	int64_t metadataBlockNumber;
 	bool hasSourceBlocksChecksum;
 	CryptoPP::byte sourceBlocksChecksum[CryptoPP::Weak::MD5::DIGESTSIZE];
-	BlockList blockInfo;
 
+	// This version's list of blocks (which can refer back to the previous version's) is stored by its FileHistory, as
+	// the run blockInfo[firstBlockInfo .. firstBlockInfo + blockInfoCount) of its shared array:
+	uint32_t firstBlockInfo;
+	uint32_t blockInfoCount;
+
+	/**
+	 * Read the version, appending its list of blocks to blockInfo.
+	 */
 	template<typename T>
-	void readFrom(T &stream, int dataVersion) {
+	void readFrom(T &stream, int dataVersion, BlockList &blockInfo) {
 		SourceFileVersion::readFrom(stream);
 
 		handlerId = readInt16BE(stream);
@@ -118,9 +172,15 @@ public:
 
 		int32_t blockCount = readInt32BE(stream);
 
-		blockInfo.resize(blockCount);
+		if (blockCount < 0 || blockInfo.size() + blockCount > std::numeric_limits<uint32_t>::max()) {
+			throw std::runtime_error("Bad block count in file history");
+		}
+
+		firstBlockInfo = (uint32_t) blockInfo.size();
+		blockInfoCount = (uint32_t) blockCount;
+
 		for (int32_t i = 0; i < blockCount; i++) {
-			blockInfo[i] = readInt64BE(stream);
+			blockInfo.push_back(readInt64BE(stream));
 		}
 	}
 };
@@ -139,27 +199,87 @@ public:
 
 	std::string path;
 
-	bool hasHistory() {
+	bool hasHistory() const {
 		return fileHistoryPosition > -1 && fileHistoryLength > 0
 			   && fileHistoryLength < std::numeric_limits<int32_t>::max();
 	}
+
+	/**
+	 * Read the fixed-length part of the record (everything but the path).
+	 */
+	template<typename T>
+	void readFrom(T &stream) {
+		readBytes(fileId, stream, sizeof(fileId));
+		readBytes(parentFileId, stream, sizeof(parentFileId));
+		fileType = readUInt8(stream);
+
+		version.readFrom(stream);
+
+		fileHistoryPosition = readInt64BE(stream);
+		fileHistoryLength = readInt32BE(stream);
+		encPathLen = readInt16BE(stream);
+	}
 } FileManifestHeader;
 
+/**
+ * Reads the records of the file manifest (cpfmf) from a memory mapping of it. Each record's encrypted path is returned
+ * as a view into the mapping rather than a copy, so reading a record doesn't allocate.
+ */
+class FileManifestReader {
+private:
+	std::shared_ptr<const MappedFile> manifest;
+	uint64_t position;
+
+public:
+	explicit FileManifestReader(const std::string &filename) : manifest(std::make_shared<MappedFile>(filename)), position(0) {
+	}
+
+	/**
+	 * Read from a mapping that is shared with other readers (e.g. to read different parts of the manifest in parallel).
+	 */
+	explicit FileManifestReader(std::shared_ptr<const MappedFile> manifest) : manifest(std::move(manifest)), position(0) {
+	}
+
+	std::shared_ptr<const MappedFile> getMapping() const {
+		return manifest;
+	}
+
+	/**
+	 * Read the record at the current position into header (apart from its path, which is left alone) and move past
+	 * it. Returns false at the end of the manifest. A truncated final record is treated as the end.
+	 */
+	bool next(FileManifestHeader &header, boost::string_view &encryptedPath);
+
+	uint64_t tell() const {
+		return position;
+	}
+
+	void seek(uint64_t offset) {
+		position = offset;
+	}
+};
+
+class FileHistory;
+
 class FileHistorySnapshot {
 public:
-	ArchivedFileVersion version;
+	// Points into the FileHistory being iterated:
+	const ArchivedFileVersion *version;
 	BlockList blockList;
 };
 
 class FileHistoryIterator {
 private:
-	std::vector<ArchivedFileVersion> *versions;
+	const FileHistory *history;
 	int index;
 
 	FileHistorySnapshot snapshot;
 
+	// The previous revision's block list, kept so its storage can be reused:
+	BlockList previousBlockList;
+
 public:
-	explicit FileHistoryIterator(std::vector<ArchivedFileVersion> *versions, bool end = false);
+	explicit FileHistoryIterator(const FileHistory *history, bool end = false);
 	FileHistoryIterator (const FileHistoryIterator &);
 	FileHistoryIterator& operator= (const FileHistoryIterator& that);
 
@@ -173,6 +293,11 @@ public:
 	FileHistorySnapshot* operator ->();
 };
 
+/**
+ * The revisions of a file. The block lists of all the revisions are stored together in one array rather than one per
+ * revision, so decoding a history into an existing FileHistory (see BackupArchive::getFileHistory) reuses its storage
+ * and usually doesn't need to allocate at all.
+ */
 class FileHistory {
 public:
 	typedef FileHistoryIterator iterator;
@@ -182,12 +307,42 @@ public:
 
 	std::vector<ArchivedFileVersion> versions;
 
-	iterator begin() {
-		return iterator(&versions);
+	// The unresolved block lists of every version, which refer to their part of it:
+	BlockList blockInfo;
+
+	/**
+	 * Remove the versions, keeping the storage for reuse.
+	 */
+	void clear() {
+		versions.clear();
+		blockInfo.clear();
 	}
 
-	iterator end() {
-		return iterator(&versions, true);
+	/**
+	 * The version's own list of blocks, whose back-references haven't been resolved.
+	 */
+	BlockListView getBlockInfo(const ArchivedFileVersion &version) const {
+		return BlockListView(blockInfo.data() + version.firstBlockInfo, version.blockInfoCount);
+	}
+
+	/**
+	 * Find the newest version backed up at or before the given archive timestamp (versions are stored in the order they
+	 * were backed up), returning -1 if there isn't one.
+	 */
+	int findVersionAt(int64_t timestamp) const;
+
+	/**
+	 * Resolve the full list of blocks of the version at the given index into result. Only the versions back to the
+	 * nearest one whose list has no back-references are resolved, rather than the whole history.
+	 */
+	void resolveBlockList(int index, BlockList &result) const;
+
+	iterator begin() const {
+		return iterator(this);
+	}
+
+	iterator end() const {
+		return iterator(this, true);
 	}
 };
 
@@ -197,40 +352,121 @@ enum class FilenameMatchMode {
 	equals
 };
 
+bool filenameMatches(const std::string &path, FilenameMatchMode matchMode, const std::string &search);
+
+class PathFilter;
+
+std::string decryptEncryptedPath(boost::string_view path, const std::string &key);
+
+/**
+ * A file whose decrypted path is already known (e.g. from the path catalog), along with the offset of its record in
+ * the file manifest.
+ */
+class FileManifestLocation {
+public:
+	int64_t offset;
+	std::string path;
+};
+
+/**
+ * What BackupArchive::forEachFile produced for a batch of files, to be written out in manifest order.
+ */
+class FileBatchOutput {
+public:
+	std::string output;
+	std::string errors;
+};
+
+/**
+ * A forward cursor over the matching files of the file manifest.
+ *
+ * The current file is held by the iterator and returned by reference, its storage is reused for the next file. The
+ * iterator can be moved but not copied, use tell() and seek() to come back to a file later.
+ */
 class BackupArchiveFileIterator {
 private:
 	std::string fileManifestFilename;
-	FILE *manifestFile;
+	std::unique_ptr<FileManifestReader> manifestReader;
 	bool isEnd;
 
 	FileManifestHeader currentFile;
+	uint64_t currentOffset;
 
 	std::string key;
 
 	FilenameMatchMode matchMode;
 	std::string search;
+	const PathFilter *filter;
+
+	// If set, only these files are visited (with no need to decrypt their paths):
+	std::shared_ptr<const std::vector<FileManifestLocation>> locations;
+	size_t locationIndex;
 
 	void findNextFile();
-	void openFileManifest();
 
 public:
-	BackupArchiveFileIterator(const std::string &manifestFilename);
-	BackupArchiveFileIterator(const std::string &manifestFilename, const std::string &key, FilenameMatchMode matchMode, const std::string &search);
-	BackupArchiveFileIterator (const BackupArchiveFileIterator &);
-	BackupArchiveFileIterator& operator= (const BackupArchiveFileIterator& that);
-	~BackupArchiveFileIterator();
+	explicit BackupArchiveFileIterator(const std::string &manifestFilename);
+	BackupArchiveFileIterator(const std::string &manifestFilename, const std::string &key, FilenameMatchMode matchMode, const std::string &search,
+							  const PathFilter *filter = nullptr);
+	BackupArchiveFileIterator(const std::string &manifestFilename, std::shared_ptr<const std::vector<FileManifestLocation>> locations,
+							  const PathFilter *filter = nullptr);
+
+	BackupArchiveFileIterator(const BackupArchiveFileIterator &) = delete;
+	BackupArchiveFileIterator& operator= (const BackupArchiveFileIterator &) = delete;
+
+	BackupArchiveFileIterator(BackupArchiveFileIterator &&) = default;
+	BackupArchiveFileIterator& operator= (BackupArchiveFileIterator &&) = default;
 
 	bool operator==(const BackupArchiveFileIterator& that) const;
 	bool operator!=(const BackupArchiveFileIterator& that) const;
 
-	BackupArchiveFileIterator& operator++ ();   // pre-increment
-	BackupArchiveFileIterator operator++ (int); // post-increment
+	BackupArchiveFileIterator& operator++ ();
 
-	FileManifestHeader operator *();
+	const FileManifestHeader& operator *() const {
+		return currentFile;
+	}
+
+	const FileManifestHeader* operator ->() const {
+		return &currentFile;
+	}
+
+	/**
+	 * The offset in the file manifest of the current file's record.
+	 */
+	uint64_t tell() const {
+		return currentOffset;
+	}
+
+	/**
+	 * Move to the first matching file whose record starts at or after the given offset, which must be the start of a
+	 * record (e.g. from tell() or BackupArchive::getFileManifestOffsets()). Can't be used on the end() iterator.
+	 */
+	void seek(uint64_t offset);
 };
 
+/**
+ * Where a file's history record is stored in the file history (cphdf), and the ID of the file it belongs to.
+ */
+class FileHistoryLocation {
+public:
+	CryptoPP::byte fileId[CryptoPP::Weak::MD5::DIGESTSIZE];
+	int64_t position;
+	int32_t length;
+
+	FileHistoryLocation() : fileId{}, position(0), length(0) {
+	}
+
+	explicit FileHistoryLocation(const FileManifestHeader &file) : position(file.fileHistoryPosition), length(file.fileHistoryLength) {
+		memcpy(fileId, file.fileId, sizeof(fileId));
+	}
+};
+
+class PathCatalog;
+
 class BackupArchive {
 private:
+	friend class FileHistoryBatch;
+
 	boost::filesystem::path rootPath;
 	std::string fileManifestFilename, fileHistoryFilename;
 
@@ -238,6 +474,21 @@ private:
 	FILE *fileHistory;
 	int fileHistoryHandle;
 
+	IndexCache indexCache;
+
+	std::vector<int64_t> fileManifestOffsets;
+	bool hasFileManifestOffsets;
+
+	bool usePathCatalog;
+	std::unique_ptr<PathCatalog> pathCatalog;
+
+	void scanFileManifestOffsets();
+
+	/**
+	 * Look up the files matching the filter in the path catalog, returning false if the catalog isn't available.
+	 */
+	bool findInPathCatalog(FilenameMatchMode matchMode, const std::string &search, std::vector<FileManifestLocation> &locations);
+
 public:
 	typedef BackupArchiveFileIterator iterator;
 
@@ -250,9 +501,121 @@ public:
 
 	void cacheBlockIndex();
 
-	// Iterate files from the file manifest
-	iterator begin(FilenameMatchMode matchMode, const std::string &search);
+	/**
+	 * Keep decoded indexes for this archive in a subdirectory of the given directory, so later runs against the same
+	 * (unchanged) archive can skip rebuilding them.
+	 */
+	void setIndexCacheDirectory(const boost::filesystem::path &cacheRoot);
+
+	/**
+	 * Keep a catalog of decrypted paths in the index cache, so filtering files by path doesn't need to decrypt every
+	 * path in the manifest. Only takes effect if an index cache directory has been set.
+	 */
+	void setPathCatalogEnabled(bool enabled) {
+		usePathCatalog = enabled;
+	}
+
+	const IndexCache& getIndexCache() const {
+		return indexCache;
+	}
+
+	/**
+	 * Get the offset of every record in the file manifest (cpfmf), in file order.
+	 */
+	const std::vector<int64_t>& getFileManifestOffsets();
+
+	/**
+	 * The file manifest (cpfmf) and file history (cphdf), which indexes derived from the archive's files depend on.
+	 */
+	std::vector<boost::filesystem::path> getFileIndexSources() const {
+		return {boost::filesystem::path(fileManifestFilename), boost::filesystem::path(fileHistoryFilename)};
+	}
+
+	// Iterate files from the file manifest, optionally only those selected by the filter too (which must outlive the iterator)
+	iterator begin(FilenameMatchMode matchMode, const std::string &search, const PathFilter *filter = nullptr);
 	iterator end();
 
-	FileHistory getFileHistory(const FileManifestHeader &manifest);
+	/**
+	 * Process the matching files of the manifest (which must also be selected by the filter, if supplied) on a pool of
+	 * worker threads.
+	 *
+	 * The manifest is split into batches of records. Workers decrypt the paths in a batch, apply the filters, and call
+	 * process for each matching file to build the batch's output. The batches' output is passed to emit (on the
+	 * calling thread) in manifest order. An exception thrown by a worker is rethrown once the batches before it have
+	 * been emitted.
+	 *
+	 * If loadHistories is set, the histories of each batch's matching files are loaded together (see FileHistoryBatch)
+	 * and passed to process, otherwise (or if the file has no history) process gets nullptr.
+	 */
+	void forEachFile(FilenameMatchMode matchMode, const std::string &search, const PathFilter *filter, int jobs, bool loadHistories,
+					 const std::function<void(FileManifestHeader &file, FileHistory *history, FileBatchOutput &result)> &process,
+					 const std::function<void(const FileBatchOutput &result)> &emit);
+
+	/**
+	 * Find where the history of every file that has one is stored, in manifest order. Only the records' headers are
+	 * read, so this doesn't need the key.
+	 */
+	std::vector<FileHistoryLocation> getFileHistoryLocations() const;
+
+	// Safe to call concurrently from multiple threads
+	FileHistory getFileHistory(const FileManifestHeader &manifest) const;
+
+	/**
+	 * Read the file's history into result, reusing its storage.
+	 */
+	void getFileHistory(const FileManifestHeader &manifest, FileHistory &result) const;
+};
+
+/**
+ * Loads the histories of a window of upcoming files together. Their records are read from the file history (cphdf) in
+ * the order they're stored rather than in manifest order, and records which lie close together are fetched with a
+ * single read, so a pass over the whole manifest reads the file history almost sequentially.
+ */
+class FileHistoryBatch {
+private:
+	class Entry {
+	public:
+		FileHistoryLocation location;
+
+		bool loaded;
+		FileHistory history;
+		std::string error;
+	};
+
+	const BackupArchive &archive;
+
+	// Only the first entryCount entries are in use, the rest are kept so their storage can be reused:
+	std::vector<Entry> entries;
+	size_t entryCount;
+
+public:
+	explicit FileHistoryBatch(const BackupArchive &archive) : archive(archive), entryCount(0) {
+	}
+
+	/**
+	 * Add a file (which must have a history) to the batch, returning the index to get() its history with.
+	 */
+	size_t add(const FileManifestHeader &file) {
+		return add(FileHistoryLocation(file));
+	}
+
+	size_t add(const FileHistoryLocation &location);
+
+	size_t size() const {
+		return entryCount;
+	}
+
+	/**
+	 * Read and decode the histories of the files added since the last fetch. Errors are recorded against the files
+	 * they affect rather than thrown.
+	 */
+	void fetch();
+
+	/**
+	 * Get the history of a fetched file, throws if it couldn't be loaded. The history is only valid until the batch is
+	 * cleared.
+	 */
+	FileHistory& get(size_t index);
+
+	void clear();
 };
\ No newline at end of file
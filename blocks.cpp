@@ -2,17 +2,13 @@
 #define _POSIX_C_SOURCE 200112L
 #define _FILE_OFFSET_BITS 64
 
+#include <algorithm>
 #include <iostream>
 
 #include <cstdlib>
 #include <cstdio>
 #include <errno.h>
 
-#ifdef _WIN32
-// lseek
-#include <io.h>
-#endif
-
 #include "boost/filesystem/operations.hpp"
 #include "boost/range/iterator_range.hpp"
 
@@ -25,6 +21,8 @@ const int BLOCK_FOLDER_NAME_DIGITS = 19;
 const int BLOCK_MANIFEST_HEADER_SIZE = 256;
 const int BLOCK_MANIFEST_RECORD_SIZE = 9;
 
+const uint32_t BLOCK_INDEX_CACHE_FORMAT = 1;
+
 const int BLOCK_DATA_FILE_HEADER_LEN = 256;
 const int BLOCK_DATA_HEADER_LEN = 53;
 
@@ -44,7 +42,179 @@ static bool isValidBlockDirectoryName(const std::string & filename) {
 	return true;
 }
 
+void BlockManifestIndex::decode(const uint8_t *records, size_t count) {
+	offsetsLow.resize(count);
+	offsetsHigh.resize(count);
+	stateBits.assign((count + 63) / 64, 0);
+
+	uint64_t outOfRange = 0;
+
+	// Kept branch-free so the compiler can turn each record's big-endian load into a single byte-swapped load:
+	for (size_t i = 0; i < count; i++) {
+		const uint8_t *record = records + i * BLOCK_MANIFEST_RECORD_SIZE;
+
+		uint64_t offset = readUInt64BE(record);
+		int8_t state = (int8_t) record[8];
+
+		offsetsLow[i] = (uint32_t) offset;
+		offsetsHigh[i] = (uint16_t) (offset >> 32);
+		stateBits[i / 64] |= (uint64_t) (state >= 0) << (i % 64);
+
+		// Offsets must survive sign-extension from 48 bits:
+		outOfRange |= (offset + ((uint64_t) 1 << 47)) >> 48;
+	}
+
+	if (outOfRange) {
+		clear();
+		throw std::runtime_error("Block manifest contains an offset that is too large to index");
+	}
+}
+
+void BlockManifestIndex::clear() {
+	offsetsLow.clear();
+	offsetsHigh.clear();
+	stateBits.clear();
+}
+
+bool BlockManifestIndex::readFrom(FILE *file) {
+	uint64_t count;
+
+	if (!readCacheValue(file, count)
+		|| !readCacheArray(file, offsetsLow, count)
+		|| !readCacheArray(file, offsetsHigh, count)
+		|| !readCacheArray(file, stateBits, (count + 63) / 64)) {
+		clear();
+		return false;
+	}
+
+	return true;
+}
+
+bool BlockManifestIndex::writeTo(FILE *file) const {
+	return writeCacheValue(file, size())
+		&& writeCacheArray(file, offsetsLow)
+		&& writeCacheArray(file, offsetsHigh)
+		&& writeCacheArray(file, stateBits);
+}
+
+BlockDataFile::BlockDataFile(const boost::filesystem::path &path, bool memoryMap) : path(path), blockData(nullptr), blockDataHandle(-1) {
+	if (memoryMap) {
+		// The mapping doesn't need the file to be held open
+		blockDataMapping.reset(new MappedFile(path.string()));
+		return;
+	}
+
+	blockData = fopen(path.string().c_str(), "rb");
+
+	if (!blockData) {
+		throw std::runtime_error("Failed to open block data file (" + path.string() + ") for reading: " + strerror(errno));
+	}
+
+	blockDataHandle = fileno(blockData);
+}
+
+BlockDataFile::~BlockDataFile() {
+	if (blockData) {
+		fclose(blockData);
+	}
+}
+
+/**
+ * Read a region of the file. If the file is memory-mapped the result points directly into the mapping, otherwise the
+ * data is read into the provided buffer.
+ */
+boost::string_view BlockDataFile::read(int64_t offset, size_t len, std::string &buffer) const {
+	if (blockDataMapping) {
+		return blockDataMapping->view(offset, len);
+	}
+
+	buffer.resize(len);
+
+	read(offset, len, (uint8_t *) &buffer[0]);
+
+	return boost::string_view(buffer.data(), len);
+}
+
+boost::string_view BlockDataFile::readAvailable(int64_t offset, size_t len, std::string &buffer) const {
+	if (blockDataMapping) {
+		uint64_t fileSize = blockDataMapping->size();
+
+		if ((uint64_t) offset >= fileSize) {
+			return boost::string_view();
+		}
+
+		return blockDataMapping->view(offset, std::min((uint64_t) len, fileSize - offset));
+	}
+
+	buffer.resize(len);
+	buffer.resize(readFileAt(blockDataHandle, &buffer[0], len, offset));
+
+	return boost::string_view(buffer.data(), buffer.length());
+}
+
+void BlockDataFile::adviseWillNeed(int64_t offset, int64_t len) const {
+	if (blockDataMapping) {
+		blockDataMapping->adviseWillNeed(offset, len);
+	} else {
+		::adviseWillNeed(blockDataHandle, offset, len);
+	}
+}
+
+void BlockDataFile::adviseSequential() const {
+	if (blockDataMapping) {
+		blockDataMapping->adviseSequential();
+	} else {
+		::adviseSequential(blockDataHandle);
+	}
+}
+
+void BlockDataFile::read(int64_t offset, size_t len, uint8_t *dest) const {
+	if (blockDataMapping) {
+		memcpy(dest, blockDataMapping->view(offset, len).data(), len);
+	} else if (readFileAt(blockDataHandle, dest, len, offset) != len) {
+		throw std::runtime_error("Unexpected end of file when reading block data from " + path.string());
+	}
+}
+
+void BlockDataFileCache::setOptions(bool memoryMap, size_t maxOpenFiles) {
+	std::lock_guard<std::mutex> lock(mutex);
+
+	this->memoryMap = memoryMap;
+	this->maxOpenFiles = std::max(maxOpenFiles, (size_t) 1);
+}
+
+std::shared_ptr<BlockDataFile> BlockDataFileCache::open(const BlockManifest &manifest) {
+	std::lock_guard<std::mutex> lock(mutex);
+
+	auto existing = openFilesIndex.find(&manifest);
+
+	if (existing != openFilesIndex.end()) {
+		// Move to the front of the LRU list
+		openFiles.splice(openFiles.begin(), openFiles, existing->second);
+
+		return existing->second->second;
+	}
+
+	std::shared_ptr<BlockDataFile> file = std::make_shared<BlockDataFile>(
+		manifest.directoryPath / boost::filesystem::path("cpbdf"), memoryMap
+	);
+
+	openFiles.emplace_front(&manifest, file);
+	openFilesIndex[&manifest] = openFiles.begin();
+
+	if (!memoryMap) {
+		while (openFiles.size() > maxOpenFiles) {
+			openFilesIndex.erase(openFiles.back().first);
+			openFiles.pop_back();
+		}
+	}
+
+	return file;
+}
+
 bool BlockManifest::containsBlock(int64_t blockNumber) const {
+	ensureLoaded();
+
 	blockNumber -= firstBlockNum;
 
 	if (blockNumber < 0 || blockNumber >= entries.size()) {
@@ -54,6 +224,18 @@ bool BlockManifest::containsBlock(int64_t blockNumber) const {
 	return entries[blockNumber].isValid();
 }
 
+BlockManifestEntry BlockManifest::getEntryForBlock(int64_t blockNumber) const {
+	ensureLoaded();
+
+	blockNumber -= firstBlockNum;
+
+	if (blockNumber < 0 || blockNumber >= entries.size()) {
+		throw std::runtime_error("Attempted to get offset for block that doesn't belong to this manifest");
+	}
+
+	return entries[blockNumber];
+}
+
 /**
  * Get the offset of the block's header in the block data file.
  *
@@ -61,20 +243,118 @@ bool BlockManifest::containsBlock(int64_t blockNumber) const {
  * @return
  */
 int64_t BlockManifest::getDataOffsetForBlock(int64_t blockNumber) const {
-	blockNumber -= firstBlockNum;
+	return getEntryForBlock(blockNumber).offset;
+}
 
-	if (blockNumber < 0 || blockNumber >= entries.size()) {
-		throw std::runtime_error("Attempted to get offset for block that doesn't belong to this manifest");
+std::vector<int64_t> BlockManifest::getBlocksInStorageOrder() const {
+	ensureLoaded();
+
+	std::vector<std::pair<int64_t, int64_t>> blocks;
+
+	for (size_t i = 0; i < entries.size(); i++) {
+		BlockManifestEntry entry = entries[i];
+
+		if (entry.isValid()) {
+			blocks.emplace_back(entry.offset, firstBlockNum + i);
+		}
 	}
 
-	return entries[blockNumber].offset;
+	// Blocks are normally appended in number order anyway, so this is usually already sorted
+	std::sort(blocks.begin(), blocks.end());
+
+	std::vector<int64_t> result;
+
+	result.reserve(blocks.size());
+
+	for (auto &block : blocks) {
+		result.push_back(block.second);
+	}
+
+	return result;
 }
 
-void BlockManifest::open() {
-	entries.clear();
+std::vector<uint32_t> BlockManifest::getStoredBlockSizes(int64_t &unusedBytes) const {
+	ensureLoaded();
+
+	// Every block with a position in the data file, live or not, marks where the block before it ends:
+	std::vector<std::pair<int64_t, size_t>> stored;
+
+	for (size_t i = 0; i < entries.size(); i++) {
+		BlockManifestEntry entry = entries[i];
+
+		if (entry.offset >= 0) {
+			stored.emplace_back(entry.offset, i);
+		}
+	}
+
+	std::sort(stored.begin(), stored.end());
+
+	std::vector<uint32_t> result(entries.size(), 0);
+
+	int64_t dataFileSize = boost::filesystem::file_size(directoryPath / boost::filesystem::path("cpbdf"));
+	int64_t liveBytes = 0;
+
+	for (size_t i = 0; i < stored.size(); i++) {
+		size_t index = stored[i].second;
+
+		if (!entries[index].isValid()) {
+			continue;
+		}
+
+		int64_t offset = stored[i].first;
+		size_t next = i + 1;
+
+		while (next < stored.size() && stored[next].first == offset) {
+			next++;
+		}
+
+		int64_t end;
+
+		if (next < stored.size()) {
+			end = stored[next].first;
+		} else {
+			// Nothing follows the last block to mark its end, so use its header rather than the rest of the file
+			try {
+				end = offset + BLOCK_DATA_HEADER_LEN + readBlockHeader(firstBlockNum + index).backupLen;
+			} catch (std::exception &e) {
+				end = dataFileSize;
+			}
+		}
+
+		int64_t size = std::max(std::min(std::min(end, dataFileSize) - offset, (int64_t) UINT32_MAX), (int64_t) 0);
+
+		result[index] = (uint32_t) size;
+		liveBytes += size;
+	}
+
+	unusedBytes = std::max(dataFileSize - BLOCK_DATA_FILE_HEADER_LEN - liveBytes, (int64_t) 0);
+
+	return result;
+}
+
+void BlockManifest::load() const {
+	std::lock_guard<std::mutex> lock(loadMutex);
+
+	// Another thread might have finished loading while we waited for the lock
+	if (loaded.load(std::memory_order_relaxed)) {
+		return;
+	}
 
 	boost::filesystem::path manifestPath = directoryPath / boost::filesystem::path("cpbmf");
-	boost::filesystem::path dataPath = directoryPath / boost::filesystem::path("cpbdf");
+	std::string cacheName = directoryPath.filename().string();
+
+	FILE *cacheFile = indexCache.openForReading(cacheName, BLOCK_INDEX_CACHE_FORMAT, {manifestPath});
+
+	if (cacheFile) {
+		bool cacheLoaded = entries.readFrom(cacheFile);
+
+		fclose(cacheFile);
+
+		if (cacheLoaded) {
+			loaded.store(true, std::memory_order_release);
+			return;
+		}
+	}
 
 	FILE *manifestFile = fopen(manifestPath.string().c_str(), "rb");
 
@@ -86,58 +366,69 @@ void BlockManifest::open() {
 	long manifestLength = ftell(manifestFile);
 	fseek(manifestFile, BLOCK_MANIFEST_HEADER_SIZE, SEEK_SET);
 
-	entries.resize((manifestLength - BLOCK_MANIFEST_HEADER_SIZE) / BLOCK_MANIFEST_RECORD_SIZE);
+	size_t recordCount = manifestLength > BLOCK_MANIFEST_HEADER_SIZE ? (manifestLength - BLOCK_MANIFEST_HEADER_SIZE) / BLOCK_MANIFEST_RECORD_SIZE : 0;
 
-	for (int i = 0; i < entries.size(); i++) {
-		entries[i].offset = readInt64BE(manifestFile);
-		entries[i].state = readInt8(manifestFile);
-	}
+	// Read all of the records in one go, then decode them in bulk:
+	std::vector<uint8_t> records(recordCount * BLOCK_MANIFEST_RECORD_SIZE);
 
-	if (feof(manifestFile)) {
-		throw std::runtime_error("Unexpected end of file when reading: " + manifestPath.string());
-	}
+	size_t bytesRead = records.empty() ? 0 : fread(records.data(), 1, records.size(), manifestFile);
 
 	fclose(manifestFile);
 
-	// And open the block data file for later reading...
-	blockData = fopen(dataPath.string().c_str(), "rb");
-
-	if (!blockData) {
-		throw std::runtime_error("Failed to open block data file (" + dataPath.string() + ") for reading: " + strerror(errno));
+	if (bytesRead != records.size()) {
+		throw std::runtime_error("Unexpected end of file when reading: " + manifestPath.string());
 	}
 
-	blockDataHandle = fileno(blockData);
+	entries.decode(records.data(), recordCount);
+
+	indexCache.write(cacheName, BLOCK_INDEX_CACHE_FORMAT, {manifestPath}, [this](FILE *file) {
+		return entries.writeTo(file);
+	});
+
+	loaded.store(true, std::memory_order_release);
 }
 
+/**
+ * Find the directory responsible for the given block number. The directories are sorted by their first block number,
+ * so this is a binary search for the last directory that starts at or before the block.
+ */
 const BlockManifest& BlockDirectories::getManifestForBlock(int64_t blockNumber) const {
-	int i;
+	if (directories.empty()) {
+		throw std::runtime_error("Archive has no block directories (" + rootPath.string() + ")");
+	}
 
-	for (i = 0; i < directories.size(); i++) {
-		if (blockNumber < directories[i].firstBlockNum) {
-			break;
+	auto next = std::upper_bound(directories.begin(), directories.end(), blockNumber,
+		[](int64_t number, const std::unique_ptr<BlockManifest> &directory) {
+			return number < directory->firstBlockNum;
 		}
-	}
+	);
 
-	return i > 0 ? directories[i - 1] : directories[0];
+	return next != directories.begin() ? **(next - 1) : *directories[0];
 }
 
 std::string BlockManifest::readBlockData(int64_t blockNumber, int len) const {
-	int64_t fileOffset = getDataOffsetForBlock(blockNumber);
+	std::string buffer;
+	boost::string_view data = readBlockData(blockNumber, len, buffer);
 
-	if (fileOffset < BLOCK_DATA_FILE_HEADER_LEN) {
-		throw std::runtime_error("Attempted to read a block at impossible offset");
+	if (data.data() != buffer.data()) {
+		buffer.assign(data.data(), data.size());
 	}
 
-	lseek(blockDataHandle, fileOffset + BLOCK_DATA_HEADER_LEN, SEEK_SET);
+	return buffer;
+}
 
-	std::string result;
+boost::string_view BlockManifest::readBlockData(int64_t blockNumber, int len, std::string &buffer) const {
+	int64_t fileOffset = getDataOffsetForBlock(blockNumber);
 
-	result.resize(len);
+	if (fileOffset < BLOCK_DATA_FILE_HEADER_LEN) {
+		throw std::runtime_error("Attempted to read a block at impossible offset");
+	}
 
-	// TODO retry loop
-	read(blockDataHandle, &result[0], len);
+	if (len < 0) {
+		throw std::runtime_error("Attempted to read a block with negative length");
+	}
 
-	return result;
+	return openDataFile()->read(fileOffset + BLOCK_DATA_HEADER_LEN, len, buffer);
 }
 
 DataBlock BlockManifest::readBlockHeader(int64_t blockNumber) const {
@@ -147,13 +438,10 @@ DataBlock BlockManifest::readBlockHeader(int64_t blockNumber) const {
 		throw std::runtime_error("Attempted to read a block at impossible offset");
 	}
 
-	lseek(blockDataHandle, fileOffset, SEEK_SET);
-
 	uint8_t buffer[BLOCK_DATA_HEADER_LEN];
 	uint8_t *cursor = buffer;
 
-	// TODO retry loop
-	read(blockDataHandle, buffer, sizeof(buffer));
+	openDataFile()->read(fileOffset, sizeof(buffer), buffer);
 
 	DataBlock result;
 
@@ -170,6 +458,12 @@ int64_t BlockDirectories::getDataOffsetForBlock(int64_t blockNumber) const {
 	return getManifestForBlock(blockNumber).getDataOffsetForBlock(blockNumber);
 }
 
+BlockLocation BlockDirectories::locateBlock(int64_t blockNumber) const {
+	const BlockManifest &manifest = getManifestForBlock(blockNumber);
+
+	return BlockLocation{&manifest, manifest.getEntryForBlock(blockNumber)};
+}
+
 DataBlock BlockDirectories::readBlockHeader(int64_t blockNumber) const {
 	const BlockManifest &manifest = getManifestForBlock(blockNumber);
 
@@ -182,6 +476,12 @@ std::string BlockDirectories::readBlockData(int64_t blockNumber, int len) const
 	return manifest.readBlockData(blockNumber, len);
 }
 
+boost::string_view BlockDirectories::readBlockData(int64_t blockNumber, int len, std::string &buffer) const {
+	const BlockManifest &manifest = getManifestForBlock(blockNumber);
+
+	return manifest.readBlockData(blockNumber, len, buffer);
+}
+
 BlockDirectories::BlockDirectories(const boost::filesystem::path &archiveRoot) : rootPath(archiveRoot) {
 	if (!boost::filesystem::is_directory(archiveRoot)) {
 		throw std::runtime_error("Bad BlockDirectories path " + archiveRoot.string());
@@ -196,7 +496,9 @@ BlockDirectories::BlockDirectories(const boost::filesystem::path &archiveRoot) :
 			boost::filesystem::path cpbmfPath = entry.path() / boost::filesystem::path("cpbmf");
 
 			if (boost::filesystem::is_regular_file(cpbdfPath) && boost::filesystem::is_regular_file(cpbmfPath)) {
-				directories.emplace_back(BlockManifest(
+				directories.emplace_back(new BlockManifest(
+					dataFiles,
+					indexCache,
 					entry.path(),
 					strtoull(filename.c_str() + strlen(BLOCK_FOLDER_NAME_PREFIX), nullptr, 10)
 				));
@@ -204,11 +506,132 @@ BlockDirectories::BlockDirectories(const boost::filesystem::path &archiveRoot) :
 		}
 	}
 
-	std::sort(directories.begin(), directories.end());
+	std::sort(directories.begin(), directories.end(),
+		[](const std::unique_ptr<BlockManifest> &a, const std::unique_ptr<BlockManifest> &b) {
+			return *a < *b;
+		}
+	);
+}
+
+void BlockDirectories::setDataFileOptions(bool memoryMap, size_t maxOpenFiles) {
+	dataFiles.setOptions(memoryMap, maxOpenFiles);
+}
+
+void BlockDirectories::setIndexCache(const IndexCache &cache) {
+	indexCache = cache;
 }
 
 void BlockDirectories::cacheIndex() {
 	for (auto &directory : directories) {
-		directory.open();
+		directory->open();
 	}
-}
\ No newline at end of file
+}
+
+BlockReader::BlockReader(const BlockDirectories &directories, const std::vector<int64_t> &blocks) :
+	directories(directories), blocks(blocks), windowManifest(nullptr), windowStart(0) {
+}
+
+/**
+ * Decide how far to read when fetching the block at the given index, by merging in the following blocks of the
+ * sequence for as long as they continue forwards through the same block data file.
+ */
+int64_t BlockReader::planReadEnd(size_t index, const BlockLocation &location, size_t &nextIndex) const {
+	int64_t start = location.entry.offset;
+	int64_t lastOffset = start;
+	size_t i;
+
+	for (i = index + 1; i < blocks.size(); i++) {
+		BlockLocation next = directories.locateBlock(blocks[i]);
+
+		if (next.manifest != location.manifest || next.entry.offset <= lastOffset
+			|| next.entry.offset - lastOffset > MAX_MERGE_STRIDE
+			|| next.entry.offset + BLOCK_DATA_HEADER_LEN + SPECULATIVE_PAYLOAD_LEN - start > MAX_READ_LEN) {
+			break;
+		}
+
+		lastOffset = next.entry.offset;
+	}
+
+	nextIndex = i;
+
+	// We don't know how long the final block is until we've read its header, so guess:
+	return lastOffset + BLOCK_DATA_HEADER_LEN + SPECULATIVE_PAYLOAD_LEN;
+}
+
+void BlockReader::fill(const BlockManifest &manifest, int64_t start, int64_t end) {
+	windowManifest = &manifest;
+	windowStart = start;
+	window = manifest.openDataFile()->readAvailable(start, end - start, windowBuffer);
+}
+
+DataBlock BlockReader::read(size_t index, boost::string_view &payload) {
+	int64_t blockNumber = blocks[index];
+	BlockLocation location = directories.locateBlock(blockNumber);
+	int64_t fileOffset = location.entry.offset;
+
+	if (fileOffset < BLOCK_DATA_FILE_HEADER_LEN) {
+		throw std::runtime_error("Attempted to read a block at impossible offset");
+	}
+
+	bool headerInWindow = windowManifest == location.manifest && fileOffset >= windowStart
+		&& fileOffset + BLOCK_DATA_HEADER_LEN <= windowStart + (int64_t) window.size();
+
+	if (!headerInWindow) {
+		size_t nextIndex;
+
+		fill(*location.manifest, fileOffset, planReadEnd(index, location, nextIndex));
+
+		if (window.size() < BLOCK_DATA_HEADER_LEN) {
+			throw std::runtime_error("Unexpected end of file when reading block header from " + location.manifest->directoryPath.string());
+		}
+	}
+
+	uint8_t *cursor = (uint8_t *) window.data() + (fileOffset - windowStart);
+
+	DataBlock result;
+
+	result.readFrom(cursor);
+
+	if (result.blockNum != blockNumber) {
+		throw std::runtime_error("Block in datafile's ID differs from the ID requested (bad block pointer in index)");
+	}
+
+	if (result.backupLen < 0) {
+		throw std::runtime_error("Attempted to read a block with negative length");
+	}
+
+	int64_t payloadStart = fileOffset + BLOCK_DATA_HEADER_LEN;
+	int64_t payloadEnd = payloadStart + result.backupLen;
+
+	if (payloadEnd > windowStart + (int64_t) window.size()) {
+		// Our guess at the payload length was too short, so fetch the whole block now:
+		fill(*location.manifest, fileOffset, payloadEnd);
+
+		if (windowStart + (int64_t) window.size() < payloadEnd) {
+			throw std::runtime_error("Unexpected end of file when reading block data from " + location.manifest->directoryPath.string());
+		}
+	}
+
+	payload = window.substr(payloadStart - windowStart, result.backupLen);
+
+	return result;
+}
+
+void BlockReader::adviseWillNeed() const {
+	size_t index = 0;
+
+	while (index < blocks.size()) {
+		size_t nextIndex = index + 1;
+
+		// Hints are best-effort, so bad blocks are left for read() to report
+		try {
+			BlockLocation location = directories.locateBlock(blocks[index]);
+			int64_t end = planReadEnd(index, location, nextIndex);
+
+			location.manifest->openDataFile()->adviseWillNeed(location.entry.offset, end - location.entry.offset);
+		} catch (std::exception &e) {
+		}
+
+		index = nextIndex;
+	}
+}
@@ -1,5 +1,10 @@
 #pragma once
 
+#include <atomic>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
 #include <vector>
 
 #include "boost/filesystem/path.hpp"
@@ -7,6 +12,7 @@
 #define CRYPTOPP_ENABLE_NAMESPACE_WEAK 1
 #include "cryptopp/md5.h"
 
+#include "cache.h"
 #include "common.h"
 #include "crypto.h"
 
@@ -67,26 +73,188 @@ public:
 	}
 };
 
-class BlockManifest {
+/**
+ * Compact in-memory copy of the records of a block manifest (cpbmf), stored as a structure of arrays.
+ *
+ * Each offset is packed into 48 bits split across two arrays, and the state is reduced to a bitmap that records whether
+ * it was non-negative (decoded as BLOCK_STATE_NORMAL or BLOCK_STATE_DELETED), so each block costs 6.125 bytes rather
+ * than the 16 bytes of a padded BlockManifestEntry.
+ */
+class BlockManifestIndex {
 private:
-	std::vector<BlockManifestEntry> entries;
+	std::vector<uint32_t> offsetsLow;
+	std::vector<uint16_t> offsetsHigh;
+	std::vector<uint64_t> stateBits;
+
+public:
+	/**
+	 * Replace the contents of the index by decoding the given array of 9-byte manifest records.
+	 */
+	void decode(const uint8_t *records, size_t count);
+
+	void clear();
+
+	bool readFrom(FILE *file);
+	bool writeTo(FILE *file) const;
+
+	size_t size() const {
+		return offsetsLow.size();
+	}
+
+	BlockManifestEntry operator[](size_t index) const {
+		BlockManifestEntry result;
+
+		// Sign-extend the 48-bit offset:
+		result.offset = (int64_t) ((((uint64_t) offsetsHigh[index] << 32) | offsetsLow[index]) << 16) >> 16;
+		result.state = (stateBits[index / 64] >> (index % 64)) & 1 ? BLOCK_STATE_NORMAL : BLOCK_STATE_DELETED;
+
+		return result;
+	}
+};
+
+class BlockManifest;
+
+/**
+ * Where a block lives in the archive: the directory that holds it, plus its manifest entry.
+ */
+class BlockLocation {
+public:
+	const BlockManifest *manifest;
+	BlockManifestEntry entry;
+};
+
+/**
+ * An open block data file (cpbdf), either held open for positional reads, or memory-mapped.
+ */
+class BlockDataFile {
+private:
+	boost::filesystem::path path;
+
 	FILE *blockData;
 	int blockDataHandle;
 
+	// When memory-mapping is enabled, block reads are served directly from this mapping of the block data file:
+	std::unique_ptr<MappedFile> blockDataMapping;
+
+public:
+	BlockDataFile(const boost::filesystem::path &path, bool memoryMap);
+	~BlockDataFile();
+
+	BlockDataFile(const BlockDataFile &) = delete;
+	BlockDataFile& operator= (const BlockDataFile &) = delete;
+
+	bool isMapped() const {
+		return blockDataMapping != nullptr;
+	}
+
+	boost::string_view read(int64_t offset, size_t len, std::string &buffer) const;
+	void read(int64_t offset, size_t len, uint8_t *dest) const;
+
+	/**
+	 * Like read(), but returns a short result rather than throwing if the end of the file is reached.
+	 */
+	boost::string_view readAvailable(int64_t offset, size_t len, std::string &buffer) const;
+
+	/**
+	 * Hint that the given region of the file is about to be read.
+	 */
+	void adviseWillNeed(int64_t offset, int64_t len) const;
+
+	/**
+	 * Hint that the file is about to be read from front to back.
+	 */
+	void adviseSequential() const;
+};
+
+/**
+ * Keeps the most recently used block data files open, closing the least recently used one once the limit is reached.
+ *
+ * Readers hold a shared_ptr to the file while they use it, so a file evicted by another thread stays open until its
+ * reads are done. Mapped files don't tie up a file descriptor so they are never evicted (and views into them remain
+ * valid for the life of the cache).
+ */
+class BlockDataFileCache {
+private:
+	typedef std::list<std::pair<const BlockManifest*, std::shared_ptr<BlockDataFile>>> FileList;
+
+	std::mutex mutex;
+
+	bool memoryMap;
+	size_t maxOpenFiles;
+
+	// Most recently used at the front:
+	FileList openFiles;
+	std::unordered_map<const BlockManifest*, FileList::iterator> openFilesIndex;
+
+public:
+	static const size_t DEFAULT_MAX_OPEN_FILES = 128;
+
+	BlockDataFileCache() : memoryMap(false), maxOpenFiles(DEFAULT_MAX_OPEN_FILES) {
+	}
+
+	void setOptions(bool memoryMap, size_t maxOpenFiles);
+
+	std::shared_ptr<BlockDataFile> open(const BlockManifest &manifest);
+};
+
+class BlockManifest {
+private:
+	BlockDataFileCache &dataFiles;
+	const IndexCache &indexCache;
+
+	// The manifest is loaded from disk the first time one of its blocks is looked up:
+	mutable BlockManifestIndex entries;
+	mutable std::atomic<bool> loaded;
+	mutable std::mutex loadMutex;
+
+	void load() const;
+
+	void ensureLoaded() const {
+		if (!loaded.load(std::memory_order_acquire)) {
+			load();
+		}
+	}
+
 public:
 	boost::filesystem::path directoryPath;
 	int64_t firstBlockNum;
 
-	BlockManifest(const boost::filesystem::path path, int64_t firstBlockNum) : directoryPath(path), firstBlockNum(firstBlockNum) {
+	BlockManifest(BlockDataFileCache &dataFiles, const IndexCache &indexCache, const boost::filesystem::path path, int64_t firstBlockNum) :
+		dataFiles(dataFiles), indexCache(indexCache), loaded(false), directoryPath(path), firstBlockNum(firstBlockNum) {
 	}
 
-	void open();
+	BlockManifest(const BlockManifest &) = delete;
+	BlockManifest& operator= (const BlockManifest &) = delete;
+
+	void open() const {
+		ensureLoaded();
+	}
 
 	bool containsBlock(int64_t blockNumber) const;
+	BlockManifestEntry getEntryForBlock(int64_t blockNumber) const;
 	int64_t getDataOffsetForBlock(int64_t blockNumber) const;
 
 	DataBlock readBlockHeader(int64_t blockNumber) const;
 	std::string readBlockData(int64_t blockNumber, int len) const;
+	boost::string_view readBlockData(int64_t blockNumber, int len, std::string &buffer) const;
+
+	/**
+	 * Get the numbers of all the live blocks in this directory, in the order they're stored in the block data file.
+	 */
+	std::vector<int64_t> getBlocksInStorageOrder() const;
+
+	/**
+	 * Get the space each block occupies in the block data file (including its header), indexed by block number
+	 * relative to firstBlockNum. This is measured as the distance to the next block in the file, live or not, so only
+	 * the last block's header needs to be read. Blocks that aren't live have a size of zero.
+	 *
+	 * The rest of the data file (held by deleted blocks, or not by any block) is returned in unusedBytes.
+	 */
+	std::vector<uint32_t> getStoredBlockSizes(int64_t &unusedBytes) const;
+
+	std::shared_ptr<BlockDataFile> openDataFile() const {
+		return dataFiles.open(*this);
+	}
 
 	bool operator < (const BlockManifest& that) const {
 		return firstBlockNum < that.firstBlockNum;
@@ -96,17 +264,94 @@ public:
 class BlockDirectories {
 private:
 	boost::filesystem::path rootPath;
-	std::vector<BlockManifest> directories;
+
+	BlockDataFileCache dataFiles;
+	IndexCache indexCache;
+	std::vector<std::unique_ptr<BlockManifest>> directories;
 
 	const BlockManifest& getManifestForBlock(int64_t blockNumber) const;
 
 public:
+	/**
+	 * Choose how block data files are accessed. Each directory's manifest is loaded when it is first needed, and at
+	 * most maxOpenFiles block data files are held open at a time (mapped files are not counted).
+	 */
+	void setDataFileOptions(bool memoryMap, size_t maxOpenFiles);
+
+	/**
+	 * Persist decoded block manifests in the given cache, and use them in preference to the cpbmf files while they are
+	 * still fresh. Must be called before any blocks are read.
+	 */
+	void setIndexCache(const IndexCache &cache);
+
+	/**
+	 * Load every block manifest up-front rather than on demand.
+	 */
 	void cacheIndex();
 
 	DataBlock readBlockHeader(int64_t blockNumber) const;
 	std::string readBlockData(int64_t blockNumber, int len) const;
 
+	/**
+	 * Read the data for a block, returning a view of it. If the block data files are memory-mapped then the view
+	 * points directly into the mapping, otherwise the data is read into the provided buffer.
+	 */
+	boost::string_view readBlockData(int64_t blockNumber, int len, std::string &buffer) const;
+
 	int64_t getDataOffsetForBlock(int64_t blockNumber) const;
+	BlockLocation locateBlock(int64_t blockNumber) const;
+
+	const std::vector<std::unique_ptr<BlockManifest>>& getDirectories() const {
+		return directories;
+	}
 
 	BlockDirectories(const boost::filesystem::path &archiveRoot);
-};
\ No newline at end of file
+};
+
+/**
+ * Reads a sequence of blocks (e.g. the block list of a file revision) in order.
+ *
+ * Each block's header and payload are fetched together with a single read, and runs of upcoming blocks that are
+ * stored close together in the same block data file are fetched with one large sequential read. This matters most
+ * on high-latency storage where the number of requests dominates.
+ *
+ * Not thread-safe, use one reader per thread.
+ */
+class BlockReader {
+private:
+	const BlockDirectories &directories;
+	const std::vector<int64_t> &blocks;
+
+	// Bytes of the block data file held from the most recent read:
+	const BlockManifest *windowManifest;
+	int64_t windowStart;
+	boost::string_view window;
+	std::string windowBuffer;
+
+	int64_t planReadEnd(size_t index, const BlockLocation &location, size_t &nextIndex) const;
+	void fill(const BlockManifest &manifest, int64_t start, int64_t end);
+
+public:
+	// How much of a block's payload to speculatively read along with its header:
+	static const int SPECULATIVE_PAYLOAD_LEN = 64 * 1024;
+
+	// Upper limit on the size of a single merged read:
+	static const int MAX_READ_LEN = 4 * 1024 * 1024;
+
+	// Blocks are only merged into one read when they start within this distance of the block before them:
+	static const int MAX_MERGE_STRIDE = 1024 * 1024;
+
+	BlockReader(const BlockDirectories &directories, const std::vector<int64_t> &blocks);
+
+	/**
+	 * Read the block at the given index of the sequence, returning its header and setting payload to a view of its
+	 * (still encrypted/compressed) data. The view remains valid until the next call to read().
+	 */
+	DataBlock read(size_t index, boost::string_view &payload);
+
+	/**
+	 * Hint to the OS that every block of the sequence is about to be read, so it can fetch them in the background.
+	 * Most useful when the sequence has been sorted into the order the blocks are stored in.
+	 */
+	void adviseWillNeed() const;
+};
@@ -0,0 +1,174 @@
+#define _POSIX_C_SOURCE 200112L
+#define _FILE_OFFSET_BITS 64
+
+#include <cstring>
+#include <iostream>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "boost/filesystem/operations.hpp"
+
+#include "cache.h"
+
+// Cache files are only meaningful on the machine that wrote them, so they use the native byte order (checked on load):
+static const char CACHE_MAGIC[8] = {'P', 'L', 'A', 'N', 'C', 'I', 'D', 'X'};
+static const uint32_t CACHE_BYTE_ORDER_MARK = 0x01020304;
+
+struct CacheSourceStamp {
+	uint64_t size;
+	int64_t modified;
+};
+
+static bool stampSources(const std::vector<boost::filesystem::path> &sources, std::vector<CacheSourceStamp> &stamps) {
+	boost::system::error_code err;
+
+	stamps.clear();
+
+	for (auto &source : sources) {
+		CacheSourceStamp stamp;
+
+		stamp.size = boost::filesystem::file_size(source, err);
+		if (err) {
+			return false;
+		}
+
+		stamp.modified = boost::filesystem::last_write_time(source, err);
+		if (err) {
+			return false;
+		}
+
+		stamps.push_back(stamp);
+	}
+
+	return true;
+}
+
+bool readCacheValue(FILE *file, uint64_t &value) {
+	return fread(&value, sizeof(value), 1, file) == 1;
+}
+
+bool writeCacheValue(FILE *file, uint64_t value) {
+	return fwrite(&value, sizeof(value), 1, file) == 1;
+}
+
+bool cacheHasRemaining(FILE *file, uint64_t bytes) {
+	// off_t and struct stat are 32-bit on MinGW, which would reject every cache file over 2GB:
+#ifdef _WIN32
+	struct _stat64 info;
+	int64_t position = _ftelli64(file);
+
+	if (position < 0 || _fstat64(_fileno(file), &info) != 0 || info.st_size < position) {
+		return false;
+	}
+#else
+	struct stat info;
+	off_t position = ftello(file);
+
+	if (position < 0 || fstat(fileno(file), &info) != 0 || info.st_size < position) {
+		return false;
+	}
+#endif
+
+	return bytes <= (uint64_t) (info.st_size - position);
+}
+
+IndexCache::IndexCache(const boost::filesystem::path &directory) : directory(directory) {
+	boost::filesystem::create_directories(directory);
+}
+
+boost::filesystem::path IndexCache::pathFor(const std::string &name) const {
+	return directory / boost::filesystem::path(name + ".idx");
+}
+
+FILE *IndexCache::openForReading(const std::string &name, uint32_t format, const std::vector<boost::filesystem::path> &sources) const {
+	if (!isEnabled()) {
+		return nullptr;
+	}
+
+	std::vector<CacheSourceStamp> expected;
+
+	if (!stampSources(sources, expected)) {
+		return nullptr;
+	}
+
+	FILE *file = fopen(pathFor(name).string().c_str(), "rb");
+
+	if (!file) {
+		return nullptr;
+	}
+
+	char magic[sizeof(CACHE_MAGIC)];
+	uint32_t fileFormat, byteOrder;
+	uint64_t sourceCount;
+
+	bool valid = fread(magic, sizeof(magic), 1, file) == 1 && memcmp(magic, CACHE_MAGIC, sizeof(magic)) == 0
+		&& fread(&byteOrder, sizeof(byteOrder), 1, file) == 1 && byteOrder == CACHE_BYTE_ORDER_MARK
+		&& fread(&fileFormat, sizeof(fileFormat), 1, file) == 1 && fileFormat == format
+		&& readCacheValue(file, sourceCount) && sourceCount == expected.size();
+
+	for (size_t i = 0; valid && i < expected.size(); i++) {
+		CacheSourceStamp stamp;
+
+		valid = fread(&stamp, sizeof(stamp), 1, file) == 1
+			&& stamp.size == expected[i].size && stamp.modified == expected[i].modified;
+	}
+
+	if (!valid) {
+		fclose(file);
+		return nullptr;
+	}
+
+	return file;
+}
+
+void IndexCache::write(const std::string &name, uint32_t format, const std::vector<boost::filesystem::path> &sources,
+					   const std::function<bool(FILE *)> &writer) const {
+	if (!isEnabled()) {
+		return;
+	}
+
+	std::vector<CacheSourceStamp> stamps;
+
+	if (!stampSources(sources, stamps)) {
+		return;
+	}
+
+	boost::filesystem::path finalPath = pathFor(name);
+	boost::filesystem::path tempPath = directory / boost::filesystem::unique_path(name + ".%%%%-%%%%-%%%%.tmp");
+
+	FILE *file = fopen(tempPath.string().c_str(), "wb");
+
+	if (!file) {
+		std::cerr << "Warning: Failed to create index cache file " << tempPath.string() << ": " << strerror(errno) << std::endl;
+		return;
+	}
+
+	bool success;
+	boost::system::error_code err;
+
+	try {
+		success = fwrite(CACHE_MAGIC, sizeof(CACHE_MAGIC), 1, file) == 1
+			&& fwrite(&CACHE_BYTE_ORDER_MARK, sizeof(CACHE_BYTE_ORDER_MARK), 1, file) == 1
+			&& fwrite(&format, sizeof(format), 1, file) == 1
+			&& writeCacheValue(file, stamps.size())
+			&& (stamps.empty() || fwrite(stamps.data(), sizeof(CacheSourceStamp), stamps.size(), file) == stamps.size())
+			&& writer(file);
+	} catch (...) {
+		// Don't leave the partial file behind
+		fclose(file);
+		boost::filesystem::remove(tempPath, err);
+		throw;
+	}
+
+	success = fclose(file) == 0 && success;
+
+	if (success) {
+		// Readers either see the old file or the complete new one:
+		boost::filesystem::rename(tempPath, finalPath, err);
+	}
+
+	if (!success || err) {
+		std::cerr << "Warning: Failed to write index cache file " << finalPath.string() << std::endl;
+		boost::filesystem::remove(tempPath, err);
+	}
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "boost/filesystem/path.hpp"
+
+/**
+ * Sidecar files that persist indexes derived from an archive's files, so that they don't need to be rebuilt on every
+ * run against the same archive.
+ *
+ * Each cache file records the size and modification time of the source files it was derived from. If any of those have
+ * changed the cache file is treated as stale and ignored, and the caller rebuilds it.
+ */
+class IndexCache {
+private:
+	boost::filesystem::path directory;
+
+	boost::filesystem::path pathFor(const std::string &name) const;
+
+public:
+	// A disabled cache, which never finds anything and discards writes
+	IndexCache() {
+	}
+
+	explicit IndexCache(const boost::filesystem::path &directory);
+
+	bool isEnabled() const {
+		return !directory.empty();
+	}
+
+	/**
+	 * Open the named cache file for reading, positioned after its header. Returns nullptr if the file doesn't exist, was
+	 * written in a different format, or was derived from sources that have since changed.
+	 */
+	FILE *openForReading(const std::string &name, uint32_t format, const std::vector<boost::filesystem::path> &sources) const;
+
+	/**
+	 * Write the named cache file using the given writer for the payload (which should return false on failure). The
+	 * file is replaced atomically. Failures are reported to cerr but are otherwise harmless, since the cache will just
+	 * be rebuilt next time.
+	 */
+	void write(const std::string &name, uint32_t format, const std::vector<boost::filesystem::path> &sources,
+			   const std::function<bool(FILE *)> &writer) const;
+};
+
+/**
+ * Check that the file has at least the given number of bytes left to read, so a count read from a damaged cache file
+ * can be rejected before anything is allocated for it.
+ */
+bool cacheHasRemaining(FILE *file, uint64_t bytes);
+
+template<typename T>
+bool readCacheArray(FILE *file, std::vector<T> &values, uint64_t count) {
+	if (count > SIZE_MAX / sizeof(T) || !cacheHasRemaining(file, count * sizeof(T))) {
+		return false;
+	}
+
+	values.resize(count);
+
+	return count == 0 || fread(values.data(), sizeof(T), count, file) == count;
+}
+
+template<typename T>
+bool writeCacheArray(FILE *file, const std::vector<T> &values) {
+	return values.empty() || fwrite(values.data(), sizeof(T), values.size(), file) == values.size();
+}
+
+bool readCacheValue(FILE *file, uint64_t &value);
+bool writeCacheValue(FILE *file, uint64_t value);
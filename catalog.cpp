@@ -0,0 +1,206 @@
+#define _POSIX_C_SOURCE 200112L
+#define _FILE_OFFSET_BITS 64
+
+#include <algorithm>
+
+#define CRYPTOPP_ENABLE_NAMESPACE_WEAK 1
+#include "cryptopp/md5.h"
+
+#include "catalog.h"
+
+static const uint32_t PATH_CATALOG_CACHE_FORMAT = 1;
+
+/**
+ * The fixed-length part of a catalog record, the paths themselves are stored together after the records.
+ */
+struct PathCatalogRecord {
+	int64_t manifestOffset;
+	uint64_t pathOffset;
+	uint32_t pathLength;
+	uint32_t reserved;
+};
+
+PathCatalog::PathCatalog(FILE *file) : file(file), recordsStart(0), pathsStart(0), count(0) {
+}
+
+PathCatalog::~PathCatalog() {
+	fclose(file);
+}
+
+bool PathCatalog::build(const std::string &manifestFilename, const std::string &key, const std::vector<int64_t> &manifestOffsets, FILE *output) {
+	FileManifestReader reader(manifestFilename);
+	FileManifestHeader header;
+	boost::string_view encryptedPath;
+
+	std::vector<std::pair<std::string, int64_t>> paths;
+
+	paths.reserve(manifestOffsets.size());
+
+	for (int64_t offset : manifestOffsets) {
+		reader.seek(offset);
+
+		if (!reader.next(header, encryptedPath)) {
+			return false;
+		}
+
+		try {
+			paths.emplace_back(decryptEncryptedPath(encryptedPath, key), offset);
+		} catch (const std::exception &) {
+			// Probably the wrong key, leave it to the caller's scan of the manifest to report that
+			return false;
+		}
+	}
+
+	std::sort(paths.begin(), paths.end());
+
+	std::vector<PathCatalogRecord> records(paths.size());
+	uint64_t pathOffset = 0;
+
+	for (size_t i = 0; i < paths.size(); i++) {
+		records[i].manifestOffset = paths[i].second;
+		records[i].pathOffset = pathOffset;
+		records[i].pathLength = (uint32_t) paths[i].first.length();
+		records[i].reserved = 0;
+
+		pathOffset += paths[i].first.length();
+	}
+
+	if (!writeCacheValue(output, records.size()) || !writeCacheArray(output, records)) {
+		return false;
+	}
+
+	for (auto &path : paths) {
+		if (fwrite(path.first.data(), 1, path.first.length(), output) != path.first.length()) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+std::unique_ptr<PathCatalog> PathCatalog::open(const IndexCache &cache, const std::string &manifestFilename, const std::string &key,
+											   const std::vector<int64_t> &manifestOffsets) {
+	if (!cache.isEnabled()) {
+		return nullptr;
+	}
+
+	// Name the catalog after a digest of the key, so catalogs built with different keys don't collide:
+	CryptoPP::Weak::MD5 hasher;
+	std::string keyDigest(CryptoPP::Weak::MD5::DIGESTSIZE, '\0');
+
+	hasher.Update((const CryptoPP::byte *) key.data(), key.length());
+	hasher.Final((CryptoPP::byte *) &keyDigest[0]);
+
+	std::string name = "paths-" + binStringToHex(keyDigest);
+	std::vector<boost::filesystem::path> sources = {boost::filesystem::path(manifestFilename)};
+
+	FILE *source = cache.openForReading(name, PATH_CATALOG_CACHE_FORMAT, sources);
+
+	if (!source) {
+		cache.write(name, PATH_CATALOG_CACHE_FORMAT, sources, [&manifestFilename, &key, &manifestOffsets](FILE *output) {
+			return build(manifestFilename, key, manifestOffsets, output);
+		});
+
+		source = cache.openForReading(name, PATH_CATALOG_CACHE_FORMAT, sources);
+
+		if (!source) {
+			return nullptr;
+		}
+	}
+
+	std::unique_ptr<PathCatalog> result(new PathCatalog(source));
+
+	if (!readCacheValue(source, result->count)) {
+		return nullptr;
+	}
+
+	result->recordsStart = ftello(source);
+	result->pathsStart = result->recordsStart + result->count * sizeof(PathCatalogRecord);
+
+	return result;
+}
+
+uint64_t PathCatalog::findBoundary(const std::string &search, bool truncate, bool after) const {
+	PathCatalogRecord record;
+	std::string path;
+
+	uint64_t low = 0, high = count;
+
+	while (low < high) {
+		uint64_t middle = low + (high - low) / 2;
+
+		if (readFileAt(fileno(file), &record, sizeof(record), recordsStart + middle * sizeof(record)) != sizeof(record)) {
+			throw std::runtime_error("Path catalog is truncated");
+		}
+
+		size_t compareLength = truncate ? std::min((size_t) record.pathLength, search.length()) : record.pathLength;
+
+		path.resize(compareLength);
+
+		if (compareLength > 0 && readFileAt(fileno(file), &path[0], compareLength, pathsStart + record.pathOffset) != compareLength) {
+			throw std::runtime_error("Path catalog is truncated");
+		}
+
+		int comparison = path.compare(search);
+
+		if (comparison < 0 || (after && comparison == 0)) {
+			low = middle + 1;
+		} else {
+			high = middle;
+		}
+	}
+
+	return low;
+}
+
+std::vector<FileManifestLocation> PathCatalog::find(FilenameMatchMode matchMode, const std::string &search) const {
+	uint64_t first, last;
+
+	switch (matchMode) {
+		case FilenameMatchMode::prefix:
+			// Paths with the given prefix sort together, just after any shorter paths that the prefix starts with
+			first = findBoundary(search, false, false);
+			last = findBoundary(search, true, true);
+			break;
+		case FilenameMatchMode::equals:
+			first = findBoundary(search, false, false);
+			last = findBoundary(search, false, true);
+			break;
+		default:
+			first = 0;
+			last = count;
+	}
+
+	std::vector<FileManifestLocation> result;
+
+	if (first >= last) {
+		return result;
+	}
+
+	// The matching records and their paths are stored contiguously, so read them all at once:
+	std::vector<PathCatalogRecord> records(last - first);
+	size_t recordsLength = records.size() * sizeof(PathCatalogRecord);
+
+	if (readFileAt(fileno(file), records.data(), recordsLength, recordsStart + first * sizeof(PathCatalogRecord)) != recordsLength) {
+		throw std::runtime_error("Path catalog is truncated");
+	}
+
+	uint64_t pathsOffset = records.front().pathOffset;
+	std::string paths(records.back().pathOffset + records.back().pathLength - pathsOffset, '\0');
+
+	if (!paths.empty() && readFileAt(fileno(file), &paths[0], paths.length(), pathsStart + pathsOffset) != paths.length()) {
+		throw std::runtime_error("Path catalog is truncated");
+	}
+
+	result.reserve(records.size());
+
+	for (auto &record : records) {
+		result.push_back(FileManifestLocation{record.manifestOffset, paths.substr(record.pathOffset - pathsOffset, record.pathLength)});
+	}
+
+	std::sort(result.begin(), result.end(), [](const FileManifestLocation &a, const FileManifestLocation &b) {
+		return a.offset < b.offset;
+	});
+
+	return result;
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "backup.h"
+#include "cache.h"
+
+/**
+ * The decrypted path of every file in the file manifest, sorted by path and kept in the index cache, so that
+ * --filename and --prefix can find their files with a binary search instead of decrypting every path in the manifest.
+ *
+ * Each record points to its file's record in the file manifest, which in turn points to its history.
+ *
+ * Since the catalog can only be built with the archive's key, a separate catalog is kept for each key. Note that the
+ * paths are stored unencrypted.
+ */
+class PathCatalog {
+private:
+	FILE *file;
+	int64_t recordsStart, pathsStart;
+	uint64_t count;
+
+	explicit PathCatalog(FILE *file);
+
+	static bool build(const std::string &manifestFilename, const std::string &key, const std::vector<int64_t> &manifestOffsets, FILE *output);
+
+	/**
+	 * Find the index of the first record whose path (truncated to the length of search, if truncate is set) is not
+	 * less than (or if after is set, greater than) search.
+	 */
+	uint64_t findBoundary(const std::string &search, bool truncate, bool after) const;
+
+public:
+	~PathCatalog();
+
+	PathCatalog(const PathCatalog &) = delete;
+	PathCatalog& operator= (const PathCatalog &) = delete;
+
+	/**
+	 * Load the catalog for the given manifest and key from the cache, building it first if needed. Returns nullptr if
+	 * the cache is disabled or the catalog couldn't be stored there.
+	 */
+	static std::unique_ptr<PathCatalog> open(const IndexCache &cache, const std::string &manifestFilename, const std::string &key,
+											 const std::vector<int64_t> &manifestOffsets);
+
+	uint64_t size() const {
+		return count;
+	}
+
+	/**
+	 * Find the files whose path matches, in manifest order.
+	 */
+	std::vector<FileManifestLocation> find(FilenameMatchMode matchMode, const std::string &search) const;
+};
@@ -2,15 +2,30 @@
 #define _POSIX_C_SOURCE 200112L
 #define _FILE_OFFSET_BITS 64
 
+#include <algorithm>
 #include <cassert>
-#include <sstream>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <errno.h>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 
 #include "common.h"
 
 #include "cryptopp/modes.h"
 #include "cryptopp/base64.h"
 
-#include "zstr/src/zstr.hpp"
+#include "zlib.h"
 
 int64_t readInt64BE(uint8_t* &buffer) {
 	int64_t result = ((int64_t) buffer[0] << 56) | ((int64_t) buffer[1] << 48) | ((int64_t) buffer[2] << 40) | ((int64_t) buffer[3] << 32)
@@ -213,9 +228,297 @@ std::string readStreamAsString(std::istream &in) {
 	return result;
 }
 
+/**
+ * Read from the given offset of a file without using (or disturbing) the file's shared seek position, so this can be
+ * called concurrently on the same handle from many threads.
+ *
+ * Retries until the requested count has been read, so the result is only short of count if the end of file was reached.
+ */
+size_t readFileAt(int handle, void *dest, size_t count, int64_t offset) {
+	size_t total = 0;
+
+	while (total < count) {
+#ifdef _WIN32
+		OVERLAPPED overlapped = {};
+		DWORD bytesRead = 0;
+		DWORD chunk = (DWORD) std::min(count - total, (size_t) 1024 * 1024 * 1024);
+
+		overlapped.Offset = (DWORD) ((uint64_t) (offset + total) & 0xFFFFFFFF);
+		overlapped.OffsetHigh = (DWORD) ((uint64_t) (offset + total) >> 32);
+
+		if (!ReadFile((HANDLE) _get_osfhandle(handle), (char *) dest + total, chunk, &bytesRead, &overlapped)) {
+			DWORD error = GetLastError();
+
+			if (error == ERROR_HANDLE_EOF) {
+				break;
+			}
+
+			throw std::runtime_error("Failed to read from file (error " + std::to_string(error) + ")");
+		}
+#else
+		ssize_t bytesRead = pread(handle, (char *) dest + total, count - total, offset + total);
+
+		if (bytesRead < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			throw std::runtime_error(std::string("Failed to read from file: ") + strerror(errno));
+		}
+#endif
+
+		if (bytesRead == 0) {
+			break;
+		}
+
+		total += bytesRead;
+	}
+
+	return total;
+}
+
+/**
+ * Hint to the OS that the given region of the file will be read soon, so it can start reading it in ahead of time.
+ * Does nothing on platforms without a way to express this.
+ */
+void adviseWillNeed(int handle, int64_t offset, int64_t len) {
+#if defined(POSIX_FADV_WILLNEED)
+	posix_fadvise(handle, offset, len, POSIX_FADV_WILLNEED);
+#endif
+}
+
+/**
+ * Hint to the OS that the file will be read from front to back, so it can read further ahead as the reads progress
+ * (and drop pages that have already been read). Does nothing on platforms without a way to express this.
+ */
+void adviseSequential(int handle) {
+#if defined(POSIX_FADV_SEQUENTIAL)
+	posix_fadvise(handle, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+}
+
+Inflater::Inflater() : stream(new z_stream_s()), initialised(false) {
+}
+
+Inflater::~Inflater() {
+	if (initialised) {
+		inflateEnd(stream.get());
+	}
+}
+
+bool Inflater::isCompressed(boost::string_view input) {
+	if (input.length() < 2) {
+		return false;
+	}
+
+	uint8_t b0 = (uint8_t) input[0], b1 = (uint8_t) input[1];
+
+	// A gzip header, or a zlib header for a 32K window at any of the compression levels:
+	return (b0 == 0x1F && b1 == 0x8B) || (b0 == 0x78 && (b1 == 0x01 || b1 == 0x5E || b1 == 0x9C || b1 == 0xDA));
+}
+
+void Inflater::inflate(boost::string_view input, std::string &output, size_t expectedLength) {
+	if (!isCompressed(input)) {
+		output.assign(input.data(), input.length());
+		return;
+	}
+
+	z_stream_s &z = *stream;
+
+	if (!initialised) {
+		// Detect gzip or zlib from the header:
+		if (inflateInit2(&z, 15 + 32) != Z_OK) {
+			throw std::runtime_error("Failed to initialise zlib");
+		}
+
+		initialised = true;
+	} else {
+		inflateReset(&z);
+	}
+
+	// The expected length usually comes from a header that no checksum covers, so it's only trusted up to a multiple of
+	// the input's length. Beyond that the output grows as it's actually produced:
+	const size_t MAX_PRESIZE_RATIO = 16;
+
+	size_t produced = 0;
+	size_t presize = std::max(input.length() * 4, (size_t) 4096);
+
+	if (expectedLength > 0) {
+		presize = std::min(expectedLength, std::max(input.length() * MAX_PRESIZE_RATIO, (size_t) 4096));
+	}
+
+	output.resize(presize);
+
+	z.next_in = (Bytef *) input.data();
+	z.avail_in = (uInt) input.length();
+
+	while (true) {
+		if (produced == output.length()) {
+			output.resize(output.length() * 2);
+		}
+
+		z.next_out = (Bytef *) &output[produced];
+		z.avail_out = (uInt) std::min(output.length() - produced, (size_t) std::numeric_limits<uInt>::max());
+
+		uInt available = z.avail_out;
+		int status = ::inflate(&z, Z_NO_FLUSH);
+
+		produced += available - z.avail_out;
+
+		if (status == Z_STREAM_END) {
+			if (z.avail_in == 0) {
+				break;
+			}
+
+			// Another stream follows this one (e.g. concatenated gzip members)
+			inflateReset(&z);
+		} else if (status != Z_OK && status != Z_BUF_ERROR) {
+			throw std::runtime_error(std::string("Failed to decompress data: ") + (z.msg ? z.msg : "zlib error " + std::to_string(status)));
+		} else if (z.avail_in == 0 && z.avail_out > 0) {
+			// The input ended before the stream did, keep what we could decompress
+			break;
+		}
+	}
+
+	output.resize(produced);
+}
+
 std::string maybeDecompress(const std::string &buffer) {
-	std::istringstream ss(buffer, std::ios_base::in);
-	zstr::istream decompress(ss);
+	return maybeDecompress(boost::string_view(buffer));
+}
+
+std::string maybeDecompress(boost::string_view buffer) {
+	static thread_local Inflater inflater;
+	std::string result;
+
+	inflater.inflate(buffer, result);
+
+	return result;
+}
+
+#ifdef _WIN32
+
+MappedFile::MappedFile(const std::string &filename) : mapping(nullptr), length(0), mappingHandle(nullptr) {
+	HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+
+	if (file == INVALID_HANDLE_VALUE) {
+		throw std::runtime_error("Failed to open " + filename + " for mapping (error " + std::to_string(GetLastError()) + ")");
+	}
+
+	LARGE_INTEGER fileSize;
+
+	if (!GetFileSizeEx(file, &fileSize)) {
+		CloseHandle(file);
+		throw std::runtime_error("Failed to get size of " + filename);
+	}
+
+	length = fileSize.QuadPart;
+
+	// Zero-length files can't be mapped, but they don't need to be
+	if (length > 0) {
+		mappingHandle = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+
+		if (mappingHandle) {
+			mapping = (const char *) MapViewOfFile(mappingHandle, FILE_MAP_READ, 0, 0, 0);
+		}
+
+		if (!mapping) {
+			DWORD error = GetLastError();
+
+			if (mappingHandle) {
+				CloseHandle(mappingHandle);
+			}
+			CloseHandle(file);
+
+			throw std::runtime_error("Failed to memory-map " + filename + " (error " + std::to_string(error) + ")");
+		}
+	}
+
+	// The mapping keeps its own reference to the file
+	CloseHandle(file);
+}
+
+MappedFile::~MappedFile() {
+	if (mapping) {
+		UnmapViewOfFile(mapping);
+	}
+	if (mappingHandle) {
+		CloseHandle(mappingHandle);
+	}
+}
+
+#else
+
+MappedFile::MappedFile(const std::string &filename) : mapping(nullptr), length(0) {
+	int handle = open(filename.c_str(), O_RDONLY);
+
+	if (handle == -1) {
+		throw std::runtime_error("Failed to open " + filename + " for mapping: " + strerror(errno));
+	}
+
+	struct stat fileStat;
+
+	if (fstat(handle, &fileStat) != 0) {
+		int error = errno;
+		close(handle);
+		throw std::runtime_error("Failed to get size of " + filename + ": " + strerror(error));
+	}
+
+	length = fileStat.st_size;
+
+	// Zero-length files can't be mapped, but they don't need to be
+	if (length > 0) {
+		void *result = mmap(nullptr, length, PROT_READ, MAP_SHARED, handle, 0);
+
+		if (result == MAP_FAILED) {
+			int error = errno;
+			close(handle);
+			throw std::runtime_error("Failed to memory-map " + filename + ": " + strerror(error));
+		}
+
+		mapping = (const char *) result;
+	}
+
+	// The mapping keeps its own reference to the file
+	close(handle);
+}
+
+MappedFile::~MappedFile() {
+	if (mapping) {
+		munmap((void *) mapping, length);
+	}
+}
+
+#endif
+
+void MappedFile::adviseWillNeed(uint64_t offset, uint64_t len) const {
+#ifndef _WIN32
+	if (offset >= length) {
+		return;
+	}
+
+	len = std::min(len, length - offset);
+
+	// The advised range must start on a page boundary:
+	uint64_t pageSize = sysconf(_SC_PAGESIZE);
+	uint64_t alignedOffset = offset - offset % pageSize;
+
+	posix_madvise((void *) (mapping + alignedOffset), len + (offset - alignedOffset), POSIX_MADV_WILLNEED);
+#endif
+}
+
+void MappedFile::adviseSequential() const {
+#ifndef _WIN32
+	if (length > 0) {
+		posix_madvise((void *) mapping, length, POSIX_MADV_SEQUENTIAL);
+	}
+#endif
+}
+
+boost::string_view MappedFile::view(uint64_t offset, size_t len) const {
+	if (offset > length || len > length - offset) {
+		throw std::runtime_error("Attempted to read past the end of a mapped file");
+	}
 
-	return readStreamAsString(decompress);
+	return boost::string_view(mapping + offset, len);
 }
@@ -2,9 +2,12 @@
 
 #include <cstdio>
 #include <cstdint>
+#include <memory>
 #include <string>
 #include <iostream>
 
+#include "boost/utility/string_view.hpp"
+
 std::string hexStringToBin(std::string input);
 std::string binStringToHex(std::string input);
 std::string base64Decode(const char *buffer, int length);
@@ -12,6 +15,11 @@ std::string base64Decode(const std::string buffer);
 std::string base64Encode(const char *buffer, int length);
 std::string base64Encode(const std::string buffer);
 
+inline uint64_t readUInt64BE(const uint8_t *buffer) {
+	return ((uint64_t) buffer[0] << 56) | ((uint64_t) buffer[1] << 48) | ((uint64_t) buffer[2] << 40) | ((uint64_t) buffer[3] << 32)
+		   | ((uint64_t) buffer[4] << 24) | ((uint64_t) buffer[5] << 16) | ((uint64_t) buffer[6] << 8) | buffer[7];
+}
+
 int64_t readInt64BE(uint8_t* &buffer);
 int64_t readInt64BE(FILE *file);
 
@@ -32,4 +40,71 @@ void readBytes(uint8_t *dest, FILE* file, size_t count);
 
 std::string readStreamAsString(std::istream &in);
 
-std::string maybeDecompress(const std::string &buffer);
\ No newline at end of file
+size_t readFileAt(int handle, void *dest, size_t count, int64_t offset);
+void adviseWillNeed(int handle, int64_t offset, int64_t len);
+void adviseSequential(int handle);
+
+struct z_stream_s;
+
+/**
+ * Decompresses gzip or zlib data, which is recognised by its header. Data without one of those headers is assumed not
+ * to be compressed at all, and is passed through unchanged.
+ *
+ * The inflate state is kept between calls rather than set up for every buffer, so use one Inflater per thread.
+ */
+class Inflater {
+private:
+	std::unique_ptr<z_stream_s> stream;
+	bool initialised;
+
+public:
+	Inflater();
+	~Inflater();
+
+	Inflater(const Inflater &) = delete;
+	Inflater& operator= (const Inflater &) = delete;
+
+	static bool isCompressed(boost::string_view input);
+
+	/**
+	 * Decompress the input into output, replacing its contents (but reusing its storage). If the decompressed size is
+	 * known (e.g. a block's sourceLen), pass it as expectedLength so the output can be sized up front (up to a limit
+	 * based on the input's length, since a damaged header could claim anything).
+	 */
+	void inflate(boost::string_view input, std::string &output, size_t expectedLength = 0);
+};
+
+std::string maybeDecompress(const std::string &buffer);
+std::string maybeDecompress(boost::string_view buffer);
+
+/**
+ * A read-only memory mapping of an entire file.
+ */
+class MappedFile {
+private:
+	const char *mapping;
+	uint64_t length;
+
+#ifdef _WIN32
+	void *mappingHandle;
+#endif
+
+public:
+	explicit MappedFile(const std::string &filename);
+	~MappedFile();
+
+	MappedFile(const MappedFile &) = delete;
+	MappedFile& operator= (const MappedFile &) = delete;
+
+	uint64_t size() const {
+		return length;
+	}
+
+	/**
+	 * Get a view of a region of the file, throws if the region lies outside the file.
+	 */
+	boost::string_view view(uint64_t offset, size_t len) const;
+
+	void adviseWillNeed(uint64_t offset, uint64_t len) const;
+	void adviseSequential() const;
+};
\ No newline at end of file
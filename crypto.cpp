@@ -1,4 +1,5 @@
 #include <cassert>
+#include <memory>
 
 #include "crypto.h"
 #include "common.h"
@@ -153,124 +154,139 @@ std::string deriveCustomArchiveKeyV2(const std::string &userID, const std::strin
 }
 
 /**
- * Decrypt a value using AES-256 CBC, where the first block is the message IV, and verify the message padding is correct.
+ * CBC decryptors with their key schedules already computed, so each message only needs the IV to be reset. Decryptors
+ * are stateful, so each thread has its own cache. A few keys are kept since manifest paths can fall back to a
+ * different cipher than the archive's, and an account password may be used alongside the archive key.
  */
-std::string Code42AES256RandomIV::decrypt(const std::string & cipherText, const std::string &key) const {
-	// We expect the encrypted value to be padded to a full block size (padding)
-	if (cipherText.length() % CryptoPP::AES::BLOCKSIZE != 0) {
-		throw BadPaddingException();
-	}
+static thread_local bool decryptorCaching = true;
 
-	// The first block of the input is the random IV:
-	const CryptoPP::byte *iv = (const CryptoPP::byte *) cipherText.data();
-	const CryptoPP::byte *encrypted = (const CryptoPP::byte *) cipherText.data() + CryptoPP::AES::BLOCKSIZE;
-	int encryptedSize = cipherText.length() - CryptoPP::AES::BLOCKSIZE;
+void setDecryptorCaching(bool enabled) {
+	decryptorCaching = enabled;
+}
 
-	uint8_t *buffer = new uint8_t[encryptedSize];
+template<class BlockCipher>
+class CachedDecryptors {
+private:
+	static const int MAX_KEYS = 4;
 
-	CryptoPP::CBC_Mode<CryptoPP::AES>::Decryption decryptor((const CryptoPP::byte *)key.data(), 256 / 8, iv);
+	class Entry {
+	public:
+		std::string key;
+		typename CryptoPP::CBC_Mode<BlockCipher>::Decryption decryptor;
+	};
 
-	decryptor.ProcessData(buffer, encrypted, encryptedSize);
+	std::unique_ptr<Entry> entries[MAX_KEYS];
+	int nextEviction;
 
-	// Verify padding is correct after decryption:
-	uint8_t padByte = buffer[encryptedSize - 1];
+	// The most recent decryptor made with caching disabled, kept until the next call so it outlives the message:
+	std::unique_ptr<Entry> uncached;
 
-	if (padByte <= 0 || padByte > CryptoPP::AES::BLOCKSIZE) {
-		throw BadPaddingException();
+public:
+	CachedDecryptors() : nextEviction(0) {
 	}
 
-	for (int i = 1; i < padByte; i++) {
-		if (buffer[encryptedSize - 1 - i] != padByte) {
-			throw BadPaddingException();
+	typename CryptoPP::CBC_Mode<BlockCipher>::Decryption& get(const char *key, size_t keyLength, const CryptoPP::byte *iv) {
+		if (!decryptorCaching) {
+			uncached.reset(new Entry());
+			uncached->decryptor.SetKeyWithIV((const CryptoPP::byte *) key, keyLength, iv);
+
+			return uncached->decryptor;
 		}
-	}
 
-	int unpaddedLength = encryptedSize - padByte;
+		for (auto &entry : entries) {
+			if (entry && entry->key.length() == keyLength && memcmp(entry->key.data(), key, keyLength) == 0) {
+				entry->decryptor.Resynchronize(iv);
+				return entry->decryptor;
+			}
+		}
 
-	std::string result((const char *) buffer, unpaddedLength);
+		std::unique_ptr<Entry> entry(new Entry());
 
-	delete[] buffer;
+		entry->decryptor.SetKeyWithIV((const CryptoPP::byte *) key, keyLength, iv);
+		entry->key.assign(key, keyLength);
 
-	return result;
-}
+		auto &slot = entries[nextEviction];
 
-std::string Code42AESStaticIV::decrypt(const std::string & cipherText, const std::string &key) const {
-	// We expect the encrypted value to be padded to a full block size (padding)
-	if (cipherText.length() % CryptoPP::AES::BLOCKSIZE != 0) {
-		throw BadPaddingException();
+		nextEviction = (nextEviction + 1) % MAX_KEYS;
+		slot = std::move(entry);
+
+		return slot->decryptor;
 	}
+};
 
-	const CryptoPP::byte *encrypted = (const CryptoPP::byte *) cipherText.data();
-	int encryptedSize = cipherText.length();
+static thread_local CachedDecryptors<CryptoPP::Blowfish> blowfishDecryptors;
+static thread_local CachedDecryptors<CryptoPP::AES> aesDecryptors;
 
-	uint8_t *buffer = new uint8_t[encryptedSize];
+/**
+ * Decrypt a message which is padded to a whole number of blocks and verify that its padding is correct.
+ */
+template<class Decryptor>
+static std::string decryptPadded(Decryptor &decryptor, const uint8_t *encrypted, size_t length, size_t blockSize) {
+	// We expect the encrypted value to be padded to a full block size (padding)
+	if (length == 0 || length % blockSize != 0) {
+		throw BadPaddingException();
+	}
 
-	CryptoPP::CBC_Mode<CryptoPP::AES>::Decryption decryptor((const CryptoPP::byte *)key.data(), 256 / 8, AES_IV);
+	std::string result(length, '\0');
+	uint8_t *buffer = (uint8_t *) &result[0];
 
-	decryptor.ProcessData(buffer, encrypted, encryptedSize);
+	decryptor.ProcessData(buffer, (const CryptoPP::byte *) encrypted, length);
 
 	// Verify padding is correct after decryption:
-	uint8_t padByte = buffer[encryptedSize - 1];
+	uint8_t padByte = buffer[length - 1];
 
-	if (padByte <= 0 || padByte > CryptoPP::AES::BLOCKSIZE) {
+	if (padByte <= 0 || padByte > blockSize) {
 		throw BadPaddingException();
 	}
 
 	for (int i = 1; i < padByte; i++) {
-		if (buffer[encryptedSize - 1 - i] != padByte) {
+		if (buffer[length - 1 - i] != padByte) {
 			throw BadPaddingException();
 		}
 	}
 
-	int unpaddedLength = encryptedSize - padByte;
-
-	std::string result((const char *) buffer, unpaddedLength);
-
-	delete[] buffer;
+	result.resize(length - padByte);
 
 	return result;
 }
 
-std::string Code42Blowfish448::decrypt(const std::string & cipherText, const std::string & key) const {
-	// We expect the encrypted value to be padded to a full block size (padding)
-	if (cipherText.length() % CryptoPP::Blowfish::BLOCKSIZE != 0) {
+/**
+ * Decrypt a value using AES-256 CBC, where the first block is the message IV, and verify the message padding is correct.
+ */
+std::string Code42AES256RandomIV::decrypt(const uint8_t *cipherText, size_t length, const std::string &key) const {
+	if (length < CryptoPP::AES::BLOCKSIZE) {
 		throw BadPaddingException();
 	}
 
-	int encryptedSize = cipherText.length();
-	CryptoPP::CBC_Mode<CryptoPP::Blowfish>::Decryption decryptor;
-	CryptoPP::byte *buffer = new CryptoPP::byte[encryptedSize];
-
-	// Trim overlong key
-	std::string newKey(key);
-
-	if (newKey.length() > CryptoPP::Blowfish::MAX_KEYLENGTH) {
-		newKey.resize(CryptoPP::Blowfish::MAX_KEYLENGTH);
-	}
+	// The first block of the input is the random IV:
+	const CryptoPP::byte *iv = (const CryptoPP::byte *) cipherText;
+	const uint8_t *encrypted = cipherText + CryptoPP::AES::BLOCKSIZE;
+	size_t encryptedSize = length - CryptoPP::AES::BLOCKSIZE;
 
-	decryptor.SetKeyWithIV((const CryptoPP::byte *)newKey.data(), newKey.length(), BLOWFISH_IV);
-	decryptor.ProcessData(buffer, (const CryptoPP::byte *) cipherText.data(), cipherText.length());
+	auto &decryptor = aesDecryptors.get(key.data(), std::min(key.length(), (size_t) (256 / 8)), iv);
 
-	// Verify padding is correct after decryption:
-	uint8_t padByte = buffer[encryptedSize - 1];
+	return decryptPadded(decryptor, encrypted, encryptedSize, CryptoPP::AES::BLOCKSIZE);
+}
 
-	if (padByte <= 0 || padByte > CryptoPP::Blowfish::BLOCKSIZE) {
-		throw BadPaddingException();
-	}
+std::string Code42AESStaticIV::decrypt(const uint8_t *cipherText, size_t length, const std::string &key) const {
+	return decrypt(cipherText, length, key.data(), std::min(key.length(), (size_t) (256 / 8)));
+}
 
-	for (int i = 1; i < padByte; i++) {
-		if (buffer[encryptedSize - 1 - i] != padByte) {
-			throw BadPaddingException();
-		}
-	}
+std::string Code42AESStaticIV::decrypt(const uint8_t *cipherText, size_t length, const char *key, size_t keyLength) const {
+	auto &decryptor = aesDecryptors.get(key, keyLength, AES_IV);
 
-	int unpaddedLength = encryptedSize - padByte;
+	return decryptPadded(decryptor, cipherText, length, CryptoPP::AES::BLOCKSIZE);
+}
 
-	std::string result((const char *) buffer, unpaddedLength);
+std::string Code42Blowfish448::decrypt(const uint8_t *cipherText, size_t length, const std::string & key) const {
+	// Trim overlong key
+	return decrypt(cipherText, length, key.data(), std::min(key.length(), (size_t) CryptoPP::Blowfish::MAX_KEYLENGTH));
+}
 
-	delete[] buffer;
+std::string Code42Blowfish448::decrypt(const uint8_t *cipherText, size_t length, const char *key, size_t keyLength) const {
+	auto &decryptor = blowfishDecryptors.get(key, keyLength, BLOWFISH_IV);
 
-	return result;
+	return decryptPadded(decryptor, cipherText, length, CryptoPP::Blowfish::BLOCKSIZE);
 }
 
 std::string generateSmallBusinessKeyV2(const std::string &passphrase, const std::string &salt) {
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <algorithm>
+#include <cstdint>
 #include <string>
 #include <stdexcept>
 
@@ -26,54 +28,89 @@ public:
 
 class Code42Cipher {
 public:
-	virtual std::string decrypt(const std::string & cipherText, const std::string & key) const = 0;
+	/**
+	 * Decrypt the given buffer. The cipherText is only read, so it may point directly into a memory-mapped block
+	 * data file.
+	 */
+	virtual std::string decrypt(const uint8_t *cipherText, size_t length, const std::string & key) const = 0;
+
+	std::string decrypt(const std::string & cipherText, const std::string & key) const {
+		return decrypt((const uint8_t *) cipherText.data(), cipherText.length(), key);
+	}
 };
 
 class Code42NullCipher : public Code42Cipher {
-	std::string decrypt(const std::string & cipherText, const std::string & key) const override {
-		return cipherText;
+public:
+	using Code42Cipher::decrypt;
+
+	std::string decrypt(const uint8_t *cipherText, size_t length, const std::string & key) const override {
+		return std::string((const char *) cipherText, length);
 	}
 };
 
 class Code42Blowfish448 : public Code42Cipher {
+protected:
+	std::string decrypt(const uint8_t *cipherText, size_t length, const char *key, size_t keyLength) const;
+
 public:
-	std::string decrypt(const std::string & cipherText, const std::string &key) const override;
+	using Code42Cipher::decrypt;
+
+	std::string decrypt(const uint8_t *cipherText, size_t length, const std::string &key) const override;
 };
 
 class Code42Blowfish128 : public Code42Blowfish448 {
 public:
-	std::string decrypt(const std::string & cipherText, const std::string &key) const override {
-		return Code42Blowfish448::decrypt(cipherText, key.substr(0, 128 / 8));
+	using Code42Cipher::decrypt;
+
+	std::string decrypt(const uint8_t *cipherText, size_t length, const std::string &key) const override {
+		return Code42Blowfish448::decrypt(cipherText, length, key.data(), std::min(key.length(), (size_t) (128 / 8)));
 	}
 };
 
 class Code42AESStaticIV : public Code42Cipher {
+protected:
+	std::string decrypt(const uint8_t *cipherText, size_t length, const char *key, size_t keyLength) const;
+
 public:
-	std::string decrypt(const std::string & cipherText, const std::string &key) const override;
+	using Code42Cipher::decrypt;
+
+	std::string decrypt(const uint8_t *cipherText, size_t length, const std::string &key) const override;
 };
 
 class Code42AES128 : public Code42AESStaticIV {
 public:
-	std::string decrypt(const std::string & cipherText, const std::string &key) const override {
-		return Code42AESStaticIV::decrypt(cipherText, key.substr(0, 128 / 8));
+	using Code42Cipher::decrypt;
+
+	std::string decrypt(const uint8_t *cipherText, size_t length, const std::string &key) const override {
+		return Code42AESStaticIV::decrypt(cipherText, length, key.data(), std::min(key.length(), (size_t) (128 / 8)));
 	}
 };
 
 class Code42AES256 : public Code42AESStaticIV {
 public:
-	std::string decrypt(const std::string & cipherText, const std::string &key) const override {
-		return Code42AESStaticIV::decrypt(cipherText, key.substr(0, 256 / 8));
+	using Code42Cipher::decrypt;
+
+	std::string decrypt(const uint8_t *cipherText, size_t length, const std::string &key) const override {
+		return Code42AESStaticIV::decrypt(cipherText, length, key.data(), std::min(key.length(), (size_t) (256 / 8)));
 	}
 };
 
 class Code42AES256RandomIV : public Code42Cipher {
 public:
-	std::string decrypt(const std::string & cipherText, const std::string &key) const override;
+	using Code42Cipher::decrypt;
+
+	std::string decrypt(const uint8_t *cipherText, size_t length, const std::string &key) const override;
 };
 
 // Use CIPHER_CODE_* as indexes:
 extern const Code42Cipher* code42Ciphers[];
 
+/**
+ * The ciphers keep decryptors with their keys already scheduled for each thread. Disabling that (for the calling thread
+ * only) makes every decrypt construct and key a new decryptor instead, so benchmarks can compare the two.
+ */
+void setDecryptorCaching(bool enabled);
+
 std::string deriveCustomArchiveKeyV2(const std::string &userID, const std::string &passphrase);
 
 bool passwordUnlocksSecureDataKey(const std::string &decoded, const std::string &password);
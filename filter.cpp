@@ -0,0 +1,408 @@
+#include <algorithm>
+#include <fstream>
+#include <stdexcept>
+
+#include "filter.h"
+
+/* Each pattern of n tokens has n + 3 automaton states, numbered from its firstState:
+ *
+ *   firstState + 0         Skipping leading path components (for patterns that can match any component)
+ *   firstState + 1 + i     About to match token i, where i == n means the whole pattern has matched
+ *   firstState + n + 2     Matching the contents of a directory that the pattern matched
+ */
+static const uint32_t STATE_PREFIX = 0;
+static const uint32_t STATE_TOKENS = 1;
+
+/* Stop adding states to the automaton once it grows this large, which needs very many complicated patterns. Paths
+ * which need more states are matched against the pattern states directly.
+ */
+static const size_t MAX_DFA_STATES = 10000;
+
+static const uint8_t ACCEPT_INCLUDE = 1;
+static const uint8_t ACCEPT_EXCLUDE = 2;
+
+void PathFilter::addPattern(const std::string &pattern, bool exclude) {
+	Pattern result;
+	std::string text = pattern;
+
+	// A trailing slash just says the pattern is a directory, which it'll match anyway:
+	while (text.length() > 1 && text.back() == '/') {
+		text.pop_back();
+	}
+
+	if (text.empty()) {
+		throw std::runtime_error("Empty filter pattern");
+	}
+
+	result.exclude = exclude;
+	result.anyComponent = text.find('/') == std::string::npos;
+
+	for (size_t i = 0; i < text.length(); i++) {
+		Token token;
+
+		token.character = (uint8_t) text[i];
+		token.characterClass = 0;
+
+		switch (text[i]) {
+			case '*':
+				if (i + 1 < text.length() && text[i + 1] == '*') {
+					token.type = TokenType::globstar;
+
+					while (i + 1 < text.length() && text[i + 1] == '*') {
+						i++;
+					}
+
+					if (i + 1 < text.length() && text[i + 1] == '/') {
+						token.type = TokenType::directories;
+						result.tokens.push_back(token);
+
+						token.type = TokenType::directoriesLoop;
+						i++;
+					}
+				} else {
+					token.type = TokenType::star;
+				}
+				break;
+			case '?':
+				token.type = TokenType::anyCharacter;
+				break;
+			case '[': {
+				size_t j = i + 1;
+				bool negate = j < text.length() && (text[j] == '!' || text[j] == '^');
+
+				if (negate) {
+					j++;
+				}
+
+				// A "]" straight after the opening bracket is part of the class rather than closing it
+				size_t close = text.find(']', j + 1);
+
+				if (close == std::string::npos) {
+					// Not a class after all, so just a literal "["
+					token.type = TokenType::literal;
+					break;
+				}
+
+				std::bitset<256> members;
+
+				for (; j < close; j++) {
+					if (j + 2 < close && text[j + 1] == '-') {
+						for (int c = (uint8_t) text[j]; c <= (uint8_t) text[j + 2]; c++) {
+							members.set(c);
+						}
+						j += 2;
+					} else {
+						members.set((uint8_t) text[j]);
+					}
+				}
+
+				if (negate) {
+					members.flip();
+				}
+
+				// Like "*" and "?", classes never match the path separator
+				members.reset('/');
+
+				token.type = TokenType::characterClass;
+				token.characterClass = (uint32_t) characterClasses.size();
+				characterClasses.push_back(members);
+
+				i = close;
+				break;
+			}
+			default:
+				token.type = TokenType::literal;
+		}
+
+		result.tokens.push_back(token);
+	}
+
+	result.firstState = (uint32_t) statePatterns.size();
+	statePatterns.insert(statePatterns.end(), result.tokens.size() + 3, (uint32_t) patterns.size());
+
+	patterns.push_back(result);
+
+	if (!exclude) {
+		hasIncludes = true;
+	}
+
+	resetDFA();
+}
+
+void PathFilter::loadFile(const std::string &filename) {
+	std::ifstream file(filename);
+
+	if (!file) {
+		throw std::runtime_error("Failed to open filter file '" + filename + "'");
+	}
+
+	std::string line;
+
+	while (std::getline(file, line)) {
+		if (!line.empty() && line.back() == '\r') {
+			line.pop_back();
+		}
+
+		if (line.empty() || line[0] == '#') {
+			continue;
+		}
+
+		if (line.compare(0, 2, "- ") == 0) {
+			exclude(line.substr(2));
+		} else if (line.compare(0, 2, "+ ") == 0) {
+			include(line.substr(2));
+		} else {
+			include(line);
+		}
+	}
+}
+
+/**
+ * Add the states which can be reached from the given ones without consuming a character.
+ */
+void PathFilter::addClosure(std::vector<uint32_t> &states) const {
+	for (size_t i = 0; i < states.size(); i++) {
+		const Pattern &pattern = patterns[statePatterns[states[i]]];
+		uint32_t offset = states[i] - pattern.firstState;
+
+		if (offset < STATE_TOKENS || offset >= STATE_TOKENS + pattern.tokens.size()) {
+			continue;
+		}
+
+		const Token &token = pattern.tokens[offset - STATE_TOKENS];
+
+		// Stars can match nothing at all
+		if (token.type == TokenType::star || token.type == TokenType::globstar) {
+			states.push_back(states[i] + 1);
+		} else if (token.type == TokenType::directories) {
+			states.push_back(states[i] + 1);
+			states.push_back(states[i] + 2);
+		}
+	}
+
+	std::sort(states.begin(), states.end());
+	states.erase(std::unique(states.begin(), states.end()), states.end());
+}
+
+/**
+ * Find the pattern states reached by consuming the character from the given ones (not including their closure).
+ */
+void PathFilter::advance(const std::vector<uint32_t> &states, uint8_t character, std::vector<uint32_t> &result) const {
+	result.clear();
+
+	for (uint32_t state : states) {
+		const Pattern &pattern = patterns[statePatterns[state]];
+		uint32_t offset = state - pattern.firstState;
+
+		if (offset == STATE_PREFIX) {
+			result.push_back(state);
+
+			if (character == '/') {
+				result.push_back(pattern.firstState + STATE_TOKENS);
+			}
+		} else if (offset < STATE_TOKENS + pattern.tokens.size()) {
+			const Token &token = pattern.tokens[offset - STATE_TOKENS];
+
+			switch (token.type) {
+				case TokenType::literal:
+					if (character == token.character) {
+						result.push_back(state + 1);
+					}
+					break;
+				case TokenType::anyCharacter:
+					if (character != '/') {
+						result.push_back(state + 1);
+					}
+					break;
+				case TokenType::characterClass:
+					if (characterClasses[token.characterClass].test(character)) {
+						result.push_back(state + 1);
+					}
+					break;
+				case TokenType::star:
+					if (character != '/') {
+						result.push_back(state);
+					}
+					break;
+				case TokenType::globstar:
+					result.push_back(state);
+					break;
+				case TokenType::directories:
+					// Only passed through on the way to the states that follow it
+					break;
+				case TokenType::directoriesLoop:
+					result.push_back(state);
+
+					if (character == '/') {
+						result.push_back(state + 1);
+					}
+					break;
+			}
+		} else if (offset == STATE_TOKENS + pattern.tokens.size()) {
+			// The pattern matched a directory, so it matches its contents too
+			if (character == '/') {
+				result.push_back(state + 1);
+			}
+		} else {
+			result.push_back(state);
+		}
+	}
+}
+
+uint8_t PathFilter::getAccepts(const std::vector<uint32_t> &states) const {
+	uint8_t accepts = 0;
+
+	for (uint32_t state : states) {
+		const Pattern &pattern = patterns[statePatterns[state]];
+		uint32_t offset = state - pattern.firstState;
+
+		if (offset >= STATE_TOKENS + pattern.tokens.size()) {
+			accepts |= pattern.exclude ? ACCEPT_EXCLUDE : ACCEPT_INCLUDE;
+		}
+	}
+
+	return accepts;
+}
+
+/**
+ * Find the automaton state for the given pattern states (after adding their closure), adding it if it's new. Returns
+ * -1 if it's new but the automaton is full. Must be called with the mutex held.
+ */
+int32_t PathFilter::findDFAState(std::vector<uint32_t> &states) const {
+	addClosure(states);
+
+	auto found = dfaStateIds.find(states);
+
+	if (found != dfaStateIds.end()) {
+		return found->second;
+	}
+
+	if (dfaStates.size() >= MAX_DFA_STATES) {
+		return -1;
+	}
+
+	int32_t id = (int32_t) dfaStates.size();
+
+	if (id % DFA_CHUNK_STATES == 0) {
+		dfaChunkStorage.emplace_back(new DFAChunk());
+		dfaChunks[id / DFA_CHUNK_STATES].store(dfaChunkStorage.back().get(), std::memory_order_release);
+	}
+
+	DFAChunk &chunk = getDFAChunk(id);
+
+	for (auto &transition : chunk.transitions[id % DFA_CHUNK_STATES]) {
+		transition.store(-1, std::memory_order_relaxed);
+	}
+
+	chunk.accepts[id % DFA_CHUNK_STATES] = getAccepts(states);
+
+	dfaStateIds.emplace(states, id);
+	dfaStates.push_back(states);
+
+	return id;
+}
+
+/**
+ * Build the transition from the automaton state for the character, returning the state it leads to, or -1 if that
+ * would be a new state and the automaton is full.
+ */
+int32_t PathFilter::step(int32_t dfaState, uint8_t character) const {
+	std::lock_guard<std::mutex> lock(mutex);
+
+	std::atomic<int32_t> &transition = getDFAChunk(dfaState).transitions[dfaState % DFA_CHUNK_STATES][character];
+
+	// Another thread might have built it while we waited for the lock
+	int32_t next = transition.load(std::memory_order_relaxed);
+
+	if (next != -1) {
+		return next;
+	}
+
+	std::vector<uint32_t> nextStates;
+
+	advance(dfaStates[dfaState], character, nextStates);
+
+	next = findDFAState(nextStates);
+
+	if (next != -1) {
+		// Publishes the new state along with the transition:
+		transition.store(next, std::memory_order_release);
+	}
+
+	return next;
+}
+
+void PathFilter::resetDFA() {
+	dfaStateIds.clear();
+	dfaStates.clear();
+	dfaChunkStorage.clear();
+	dfaChunks.reset(new std::atomic<DFAChunk*>[(MAX_DFA_STATES + DFA_CHUNK_STATES - 1) / DFA_CHUNK_STATES]());
+
+	// State 0 is the start state:
+	std::vector<uint32_t> start;
+
+	for (auto &pattern : patterns) {
+		if (pattern.anyComponent) {
+			start.push_back(pattern.firstState + STATE_PREFIX);
+		}
+		start.push_back(pattern.firstState + STATE_TOKENS);
+	}
+
+	findDFAState(start);
+}
+
+/**
+ * Finish matching the path from the given position by following the pattern states directly, for when the automaton
+ * is full. Returns the ACCEPT_* flags of the states the path ends in.
+ */
+uint8_t PathFilter::matchWithoutDFA(int32_t dfaState, const std::string &path, size_t start) const {
+	std::vector<uint32_t> states, nextStates;
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+
+		states = dfaStates[dfaState];
+	}
+
+	for (size_t i = start; i < path.length(); i++) {
+		advance(states, (uint8_t) path[i], nextStates);
+		addClosure(nextStates);
+
+		states.swap(nextStates);
+	}
+
+	return getAccepts(states);
+}
+
+bool PathFilter::matches(const std::string &path) const {
+	if (patterns.empty()) {
+		return true;
+	}
+
+	int32_t state = 0;
+	uint8_t accepts;
+	size_t i;
+
+	for (i = 0; i < path.length(); i++) {
+		uint8_t character = (uint8_t) path[i];
+		int32_t next = getDFAChunk(state).transitions[state % DFA_CHUNK_STATES][character].load(std::memory_order_acquire);
+
+		if (next == -1) {
+			next = step(state, character);
+
+			if (next == -1) {
+				break;
+			}
+		}
+
+		state = next;
+	}
+
+	if (i < path.length()) {
+		accepts = matchWithoutDFA(state, path, i);
+	} else {
+		accepts = getDFAChunk(state).accepts[state % DFA_CHUNK_STATES];
+	}
+
+	return (!hasIncludes || (accepts & ACCEPT_INCLUDE) != 0) && (accepts & ACCEPT_EXCLUDE) == 0;
+}
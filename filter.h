@@ -0,0 +1,128 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <bitset>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/**
+ * Selects files by matching their paths against any number of include and exclude glob patterns. A path is selected
+ * if it matches at least one include pattern (or there are none) and no exclude patterns.
+ *
+ * Patterns support "*" (any run of characters within a path component), "**" (any run of characters including "/",
+ * when followed by a "/" it matches any number of whole directories), "?" (any one character other than "/") and
+ * "[...]" classes of characters (with "!" or "^" to negate). A pattern that
+ * matches a directory also matches everything inside it. Patterns containing a "/" must match from the start of the
+ * path, others can match any component of it, e.g. "*.tmp" or "node_modules".
+ *
+ * All the patterns are compiled into a single automaton, so each path is tested with one pass over its characters no
+ * matter how many patterns there are. Its states are built lazily as paths need them. Safe to share between threads,
+ * which only need to take a lock to build a state.
+ */
+class PathFilter {
+private:
+	enum class TokenType : uint8_t {
+		literal,
+		anyCharacter,
+		star,
+		globstar,
+		// "**/", which matches any number of whole directories. It's followed by a directoriesLoop token for the state of
+		// having matched some of a directory's name, which can only be left at a "/":
+		directories,
+		directoriesLoop,
+		characterClass
+	};
+
+	class Token {
+	public:
+		TokenType type;
+		uint8_t character;
+		uint32_t characterClass;
+	};
+
+	class Pattern {
+	public:
+		std::vector<Token> tokens;
+		bool exclude;
+		bool anyComponent;
+
+		// The ID of the first of this pattern's automaton states:
+		uint32_t firstState;
+	};
+
+	std::vector<Pattern> patterns;
+	std::vector<std::bitset<256>> characterClasses;
+	bool hasIncludes;
+
+	// Pattern automaton states (see stateCount()) are mapped back to their pattern:
+	std::vector<uint32_t> statePatterns;
+
+	static const size_t DFA_CHUNK_STATES = 64;
+
+	// Automaton states are allocated in chunks that never move, so readers can use them while more are being added:
+	class DFAChunk {
+	public:
+		std::array<std::atomic<int32_t>, 256> transitions[DFA_CHUNK_STATES];
+		uint8_t accepts[DFA_CHUNK_STATES];
+	};
+
+	/* The lazily-built deterministic automaton. Each of its states is a set of pattern states, and its transitions are
+	 * filled in as they're first needed (-1 until then). Transitions that have been filled in are followed without
+	 * the mutex, which guards everything else.
+	 */
+	mutable std::mutex mutex;
+	mutable std::map<std::vector<uint32_t>, int32_t> dfaStateIds;
+	mutable std::vector<std::vector<uint32_t>> dfaStates;
+	mutable std::vector<std::unique_ptr<DFAChunk>> dfaChunkStorage;
+
+	// Readers find each chunk here, since dfaChunkStorage can be appended to at any time:
+	std::unique_ptr<std::atomic<DFAChunk*>[]> dfaChunks;
+
+	void addPattern(const std::string &pattern, bool exclude);
+
+	void addClosure(std::vector<uint32_t> &states) const;
+	void advance(const std::vector<uint32_t> &states, uint8_t character, std::vector<uint32_t> &result) const;
+	uint8_t getAccepts(const std::vector<uint32_t> &states) const;
+
+	int32_t findDFAState(std::vector<uint32_t> &states) const;
+	int32_t step(int32_t dfaState, uint8_t character) const;
+	void resetDFA();
+
+	DFAChunk& getDFAChunk(int32_t dfaState) const {
+		return *dfaChunks[dfaState / DFA_CHUNK_STATES].load(std::memory_order_acquire);
+	}
+
+	uint8_t matchWithoutDFA(int32_t dfaState, const std::string &path, size_t start) const;
+
+public:
+	PathFilter() : hasIncludes(false) {
+	}
+
+	PathFilter(const PathFilter &) = delete;
+	PathFilter& operator= (const PathFilter &) = delete;
+
+	void include(const std::string &pattern) {
+		addPattern(pattern, false);
+	}
+
+	void exclude(const std::string &pattern) {
+		addPattern(pattern, true);
+	}
+
+	/**
+	 * Add the patterns listed in a file, one per line. Lines starting with "- " are excludes and lines starting with
+	 * "+ " are includes, as are lines with neither prefix. Blank lines and lines starting with "#" are ignored.
+	 */
+	void loadFile(const std::string &filename);
+
+	bool empty() const {
+		return patterns.empty();
+	}
+
+	bool matches(const std::string &path) const;
+};
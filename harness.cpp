@@ -0,0 +1,532 @@
+#define __STDC_FORMAT_MACROS
+#define _FILE_OFFSET_BITS 64
+
+#include <inttypes.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <new>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define CRYPTOPP_ENABLE_NAMESPACE_WEAK 1
+#include "cryptopp/md5.h"
+
+#include "zlib.h"
+#include "zstr/src/zstr.hpp"
+
+#include "boost/filesystem/operations.hpp"
+
+#include "common.h"
+#include "backup.h"
+#include "blocks.h"
+
+/*
+ * Stress tests and benchmarks for Plan C's internals. These are built separately from plan-c (with "make harness"), so
+ * the release binary doesn't carry them.
+ */
+
+using std::cout;
+using std::cerr;
+using std::endl;
+
+// Every allocation made through operator new, so benchmarks can report how many allocations the code they time makes:
+static std::atomic<uint64_t> allocationCount(0);
+
+void *operator new(size_t size) {
+	allocationCount.fetch_add(1, std::memory_order_relaxed);
+
+	void *result = malloc(size > 0 ? size : 1);
+
+	if (!result) {
+		throw std::bad_alloc();
+	}
+
+	return result;
+}
+
+void operator delete(void *pointer) noexcept {
+	free(pointer);
+}
+
+void operator delete(void *pointer, size_t size) noexcept {
+	free(pointer);
+}
+
+/**
+ * Read every live block of the archive from many threads at once, each thread visiting the blocks in a different
+ * order, and check each block's archived data against its backupMD5. The file histories are read by every thread at
+ * the same time, too.
+ *
+ * A block which is damaged in the archive fails for every thread, but one that fails for only some of them (or a
+ * history that decodes differently between threads) points to a race in the shared readers.
+ */
+static int stressBlockReads(const std::string &archivePath, int threads, size_t maxOpenFiles, bool memoryMap) {
+	const size_t HISTORY_BATCH_SIZE = 256;
+	const int64_t HISTORY_UNREADABLE = -2;
+
+	BackupArchive archive(archivePath, "");
+
+	archive.blockDirectories.setDataFileOptions(memoryMap, maxOpenFiles);
+
+	std::vector<int64_t> blocks;
+
+	for (auto &directory : archive.blockDirectories.getDirectories()) {
+		try {
+			std::vector<int64_t> directoryBlocks = directory->getBlocksInStorageOrder();
+
+			blocks.insert(blocks.end(), directoryBlocks.begin(), directoryBlocks.end());
+		} catch (std::exception &e) {
+			cerr << "Skipping " << directory->directoryPath.string() << ": " << e.what() << endl;
+		}
+	}
+
+	std::vector<FileHistoryLocation> histories = archive.getFileHistoryLocations();
+
+	// How many threads found each block intact, and how many didn't:
+	std::vector<std::atomic<uint32_t>> blockPasses(blocks.size()), blockFailures(blocks.size());
+
+	// The first thread to decode each history records the number of versions and blocks it found, the rest compare:
+	std::vector<std::atomic<int64_t>> historySignatures(histories.size());
+	std::atomic<uint64_t> historyMismatches(0);
+
+	for (auto &signature : historySignatures) {
+		signature.store(-1);
+	}
+
+	auto start = std::chrono::steady_clock::now();
+
+	std::vector<std::thread> workers;
+
+	for (int t = 0; t < threads; t++) {
+		workers.emplace_back([&, t]() {
+			std::string buffer;
+			CryptoPP::Weak::MD5 hasher;
+			CryptoPP::byte hash[CryptoPP::Weak::MD5::DIGESTSIZE];
+
+			// Start at a different place in the archive for each thread, and have every other thread go backwards
+			size_t first = blocks.size() * t / threads;
+
+			for (size_t i = 0; i < blocks.size(); i++) {
+				size_t index = (t % 2 == 0 ? first + i : first + blocks.size() - i) % blocks.size();
+				bool intact = false;
+
+				try {
+					DataBlock header = archive.blockDirectories.readBlockHeader(blocks[index]);
+					boost::string_view data = archive.blockDirectories.readBlockData(blocks[index], header.backupLen, buffer);
+
+					hasher.Update((const CryptoPP::byte*) data.data(), data.length());
+					hasher.Final(hash);
+
+					intact = memcmp(hash, header.backupMD5, sizeof(hash)) == 0;
+				} catch (std::exception &e) {
+				}
+
+				(intact ? blockPasses : blockFailures)[index]++;
+			}
+
+			FileHistoryBatch batch(archive);
+			size_t firstHistory = histories.size() * t / threads;
+
+			for (size_t i = 0; i < histories.size(); i += HISTORY_BATCH_SIZE) {
+				size_t count = std::min(HISTORY_BATCH_SIZE, histories.size() - i);
+
+				batch.clear();
+
+				for (size_t j = 0; j < count; j++) {
+					batch.add(histories[(firstHistory + i + j) % histories.size()]);
+				}
+
+				batch.fetch();
+
+				for (size_t j = 0; j < count; j++) {
+					size_t index = (firstHistory + i + j) % histories.size();
+					int64_t signature;
+
+					try {
+						FileHistory &history = batch.get(j);
+
+						signature = ((int64_t) history.versions.size() << 32) | history.blockInfo.size();
+					} catch (std::exception &e) {
+						signature = HISTORY_UNREADABLE;
+					}
+
+					int64_t expected = -1;
+
+					if (!historySignatures[index].compare_exchange_strong(expected, signature) && expected != signature) {
+						historyMismatches++;
+					}
+				}
+			}
+		});
+	}
+
+	for (auto &worker : workers) {
+		worker.join();
+	}
+
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	uint64_t corruptBlocks = 0, inconsistentBlocks = 0, unreadableHistories = 0;
+
+	for (size_t i = 0; i < blocks.size(); i++) {
+		if (blockFailures[i] == 0) {
+			continue;
+		}
+
+		if (blockPasses[i] == 0) {
+			cerr << "Block " << blocks[i] << " doesn't match its backupMD5" << endl;
+			corruptBlocks++;
+		} else {
+			cerr << "Block " << blocks[i] << " matched its backupMD5 for " << blockPasses[i] << " threads but not for "
+				<< blockFailures[i] << endl;
+			inconsistentBlocks++;
+		}
+	}
+
+	for (auto &signature : historySignatures) {
+		if (signature == HISTORY_UNREADABLE) {
+			unreadableHistories++;
+		}
+	}
+
+	cerr << "Columns are: threads, blocks, corrupt blocks, inconsistent blocks, histories, unreadable histories, "
+		"inconsistent histories, seconds" << endl;
+
+	printf("%d %zu %" PRIu64 " %" PRIu64 " %zu %" PRIu64 " %" PRIu64 " %.3f\n", threads, blocks.size(), corruptBlocks,
+		inconsistentBlocks, histories.size(), unreadableHistories, historyMismatches.load(), seconds);
+
+	return corruptBlocks == 0 && inconsistentBlocks == 0 && unreadableHistories == 0 && historyMismatches == 0
+		? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/**
+ * Create a stand-in archive with the given number of block directories, each with a manifest of blocksPerDirectory
+ * live blocks (and an empty block data file, since only the manifests are read).
+ */
+static void createSyntheticBlockDirectories(const boost::filesystem::path &root, int directories, int blocksPerDirectory) {
+	const int MANIFEST_HEADER_SIZE = 256;
+	const int DATA_FILE_HEADER_SIZE = 256;
+	const int BLOCK_SIZE = 4096;
+
+	std::string manifest;
+
+	for (int i = 0; i < directories; i++) {
+		char name[32];
+
+		snprintf(name, sizeof(name), "cpbf%019" PRId64, (int64_t) i * blocksPerDirectory);
+
+		boost::filesystem::path directory = root / name;
+
+		boost::filesystem::create_directories(directory);
+
+		manifest.assign(MANIFEST_HEADER_SIZE, '\0');
+
+		for (int j = 0; j < blocksPerDirectory; j++) {
+			uint64_t offset = DATA_FILE_HEADER_SIZE + (uint64_t) j * BLOCK_SIZE;
+
+			for (int k = 7; k >= 0; k--) {
+				manifest.push_back((char) (offset >> (k * 8)));
+			}
+
+			manifest.push_back((char) BLOCK_STATE_NORMAL);
+		}
+
+		std::ofstream((directory / "cpbmf").string(), std::ios::binary) << manifest;
+		std::ofstream((directory / "cpbdf").string(), std::ios::binary);
+	}
+}
+
+/**
+ * Time BlockDirectories::locateBlock() for random block numbers against archives with a growing number of block
+ * directories, next to the linear scan over the directories that it replaced.
+ */
+static int benchmarkBlockLookup() {
+	const int BLOCKS_PER_DIRECTORY = 64;
+	const int LOOKUPS = 1000000;
+
+	boost::filesystem::path root = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("plan-c-%%%%-%%%%");
+
+	cerr << "Columns are: block directories, nanoseconds per locateBlock, nanoseconds per linear scan" << endl;
+
+	try {
+		for (int directoryCount : {10, 100, 1000, 10000}) {
+			boost::filesystem::path archiveRoot = root / std::to_string(directoryCount);
+
+			createSyntheticBlockDirectories(archiveRoot, directoryCount, BLOCKS_PER_DIRECTORY);
+
+			BlockDirectories directories(archiveRoot);
+
+			directories.cacheIndex();
+
+			std::mt19937_64 random(directoryCount);
+			std::uniform_int_distribution<int64_t> blockNumbers(0, (int64_t) directoryCount * BLOCKS_PER_DIRECTORY - 1);
+			std::vector<int64_t> lookups(LOOKUPS);
+
+			for (auto &lookup : lookups) {
+				lookup = blockNumbers(random);
+			}
+
+			// Summed so the lookups can't be optimised away:
+			int64_t offsetTotal = 0, firstBlockTotal = 0;
+
+			auto start = std::chrono::steady_clock::now();
+
+			for (int64_t blockNumber : lookups) {
+				offsetTotal += directories.locateBlock(blockNumber).entry.offset;
+			}
+
+			double indexedSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+			start = std::chrono::steady_clock::now();
+
+			auto &manifests = directories.getDirectories();
+
+			for (int64_t blockNumber : lookups) {
+				size_t i = 0;
+
+				while (i + 1 < manifests.size() && manifests[i + 1]->firstBlockNum <= blockNumber) {
+					i++;
+				}
+
+				firstBlockTotal += manifests[i]->firstBlockNum;
+			}
+
+			double scanSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+			printf("%d %.1f %.1f\n", directoryCount, indexedSeconds * 1e9 / LOOKUPS, scanSeconds * 1e9 / LOOKUPS);
+
+			if (offsetTotal < 0 || firstBlockTotal < 0) {
+				cerr << "Unexpected lookup result" << endl;
+			}
+		}
+	} catch (...) {
+		boost::filesystem::remove_all(root);
+		throw;
+	}
+
+	boost::filesystem::remove_all(root);
+
+	return EXIT_SUCCESS;
+}
+
+/**
+ * Generate compressible stand-in block contents: words of text mixed with runs of random bytes.
+ */
+static std::string generateBlockContents(size_t length, std::mt19937 &random) {
+	static const char *const WORDS[] = {"the", "archive", "block", "file", "of", "and", "restore", "history", "to",
+		"backup", "manifest", "a", "data", "in", "snapshot", "path"};
+
+	std::string result;
+
+	while (result.length() < length) {
+		if (random() % 8 == 0) {
+			for (int i = 0; i < 16; i++) {
+				result.push_back((char) random());
+			}
+		} else {
+			result.append(WORDS[random() % (sizeof(WORDS) / sizeof(WORDS[0]))]).push_back(' ');
+		}
+	}
+
+	result.resize(length);
+
+	return result;
+}
+
+/**
+ * Decompress the way blocks were decompressed before Inflater: through an istringstream wrapped by zstr.
+ */
+static std::string inflateWithStream(const std::string &compressed) {
+	std::istringstream input(compressed, std::ios_base::in);
+	zstr::istream decompress(input);
+
+	return readStreamAsString(decompress);
+}
+
+/**
+ * Compare the speed of Inflater against the zstr stream it replaced, on zlib-compressed blocks of 4 KiB to 1 MiB.
+ */
+static int benchmarkInflate() {
+	const double MIN_SECONDS = 1;
+	const size_t TOTAL_BYTES = 16 * 1024 * 1024;
+
+	cerr << "Columns are: block size, compressed size, Inflater MB/s, stream MB/s" << endl;
+
+	for (size_t blockSize : {4 * 1024, 32 * 1024, 256 * 1024, 1024 * 1024}) {
+		std::mt19937 random(blockSize);
+		std::vector<std::string> blocks, compressedBlocks;
+		size_t compressedBytes = 0;
+
+		// Enough different blocks that they don't all fit in the CPU cache:
+		for (size_t i = 0; i < std::max(TOTAL_BYTES / blockSize, (size_t) 4); i++) {
+			blocks.push_back(generateBlockContents(blockSize, random));
+
+			uLongf compressedLength = compressBound(blockSize);
+			std::string compressed(compressedLength, '\0');
+
+			if (compress2((Bytef *) &compressed[0], &compressedLength, (const Bytef *) blocks.back().data(), blockSize, 6) != Z_OK) {
+				throw std::runtime_error("Failed to compress benchmark data");
+			}
+
+			compressed.resize(compressedLength);
+			compressedBytes += compressedLength;
+			compressedBlocks.push_back(std::move(compressed));
+		}
+
+		Inflater inflater;
+		std::string output;
+		double rates[2];
+
+		for (size_t i = 0; i < blocks.size(); i++) {
+			inflater.inflate(compressedBlocks[i], output, blockSize);
+
+			if (output != blocks[i] || inflateWithStream(compressedBlocks[i]) != blocks[i]) {
+				throw std::runtime_error("Decompressed block doesn't match the original");
+			}
+		}
+
+		for (int method = 0; method < 2; method++) {
+			uint64_t bytes = 0;
+			double seconds = 0;
+			auto start = std::chrono::steady_clock::now();
+
+			while (seconds < MIN_SECONDS) {
+				for (size_t i = 0; i < compressedBlocks.size(); i++) {
+					if (method == 0) {
+						// As BlockDecoder does, with the size from the block header:
+						inflater.inflate(compressedBlocks[i], output, blockSize);
+					} else {
+						output = inflateWithStream(compressedBlocks[i]);
+					}
+
+					bytes += output.length();
+				}
+
+				seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			}
+
+			rates[method] = bytes / seconds / (1024 * 1024);
+		}
+
+		printf("%zu %zu %.0f %.0f\n", blockSize, compressedBytes / compressedBlocks.size(), rates[0], rates[1]);
+	}
+
+	return EXIT_SUCCESS;
+}
+
+/**
+ * Decode and iterate every file history in the archive a few times, counting the allocations made per history. This
+ * is done both with a new FileHistory for each file and by decoding into one reused FileHistory.
+ */
+static int benchmarkHistoryAllocations(const std::string &archivePath) {
+	const int PASSES = 5;
+
+	BackupArchive archive(archivePath, "");
+
+	std::vector<FileManifestHeader> files;
+	FileManifestReader reader(archive.getFileIndexSources()[0].string());
+	FileManifestHeader header;
+	boost::string_view encryptedPath;
+
+	while (reader.next(header, encryptedPath)) {
+		if (header.hasHistory()) {
+			files.push_back(header);
+		}
+	}
+
+	if (files.empty()) {
+		cerr << "The archive has no file histories to decode" << endl;
+		return EXIT_FAILURE;
+	}
+
+	cerr << "Columns are: histories, history storage, histories decoded, versions, blocks, allocations per history, "
+		"allocations per version, seconds" << endl;
+
+	for (bool reuse : {false, true}) {
+		FileHistory reusedHistory;
+		uint64_t versions = 0, blocks = 0;
+
+		uint64_t allocationsBefore = allocationCount.load();
+		auto start = std::chrono::steady_clock::now();
+
+		for (int pass = 0; pass < PASSES; pass++) {
+			for (auto &file : files) {
+				FileHistory newHistory;
+
+				if (reuse) {
+					archive.getFileHistory(file, reusedHistory);
+				} else {
+					newHistory = archive.getFileHistory(file);
+				}
+
+				const FileHistory &history = reuse ? reusedHistory : newHistory;
+
+				for (auto &snapshot : history) {
+					blocks += snapshot.blockList.size();
+				}
+
+				versions += history.versions.size();
+			}
+		}
+
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		uint64_t allocations = allocationCount.load() - allocationsBefore;
+		uint64_t decoded = (uint64_t) files.size() * PASSES;
+
+		printf("%zu %s %" PRIu64 " %" PRIu64 " %" PRIu64 " %.1f %.2f %.3f\n", files.size(), reuse ? "reused" : "new",
+			decoded, versions, blocks, (double) allocations / decoded, versions > 0 ? (double) allocations / versions : 0.0,
+			seconds);
+	}
+
+	return EXIT_SUCCESS;
+}
+
+static int usage() {
+	cout << "Usage: plan-c-harness <command> [arguments]" << endl;
+	cout << "Commands:" << endl;
+	cout << "  stress-blocks <archive> [threads] [max-open-files] [mmap]" << endl;
+	cout << "      Read every block and history from many threads at once, checking each block against its backupMD5" << endl;
+	cout << "  bench-block-lookup" << endl;
+	cout << "      Time block lookups against synthetic archives with 10 to 10000 block directories" << endl;
+	cout << "  bench-inflate" << endl;
+	cout << "      Compare the speed of decompressing 4 KiB to 1 MiB blocks with Inflater and with a zstr stream" << endl;
+	cout << "  bench-history-allocations <archive>" << endl;
+	cout << "      Count the allocations made to decode and iterate each file history" << endl;
+
+	return EXIT_FAILURE;
+}
+
+int main(int argc, char **argv) {
+	std::vector<std::string> args(argv + 1, argv + argc);
+
+	try {
+		if (args.size() >= 2 && args.size() <= 5 && args[0] == "stress-blocks") {
+			int threads = args.size() > 2 ? std::stoi(args[2]) : std::max((int) std::thread::hardware_concurrency(), 1) * 4;
+			size_t maxOpenFiles = args.size() > 3 ? std::stoul(args[3]) : 4;
+			bool memoryMap = args.size() > 4 && args[4] == "mmap";
+
+			return stressBlockReads(args[1], std::max(threads, 1), std::max(maxOpenFiles, (size_t) 1), memoryMap);
+		} else if (args.size() == 1 && args[0] == "bench-block-lookup") {
+			return benchmarkBlockLookup();
+		} else if (args.size() == 1 && args[0] == "bench-inflate") {
+			return benchmarkInflate();
+		} else if (args.size() == 2 && args[0] == "bench-history-allocations") {
+			return benchmarkHistoryAllocations(args[1]);
+		}
+	} catch (std::exception &e) {
+		cerr << e.what() << endl;
+		return EXIT_FAILURE;
+	}
+
+	return usage();
+}
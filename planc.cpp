@@ -9,11 +9,20 @@
 #include <iostream>
 #include <cstdio>
 #include <ctime>
+#include <chrono>
 #include <cstdlib>
 #include <ctype.h>
 #include <sstream>
 #include <thread>
+#include <map>
+#include <set>
+#include <algorithm>
 #include <atomic>
+#include <deque>
+#include <exception>
+#include <future>
+#include <memory>
+#include <mutex>
 
 #include "zstr/src/zstr.hpp"
 
@@ -45,6 +54,12 @@
 #include "backup.h"
 #include "adb.h"
 #include "properties.h"
+#include "filter.h"
+#include "references.h"
+#include "tree.h"
+#include "restore.h"
+#include "timeline.h"
+#include "verify.h"
 
 using namespace CryptoPP;
 using namespace std;
@@ -72,7 +87,15 @@ time_t archiveTimestampToUnix(time_t time) {
 	return time / 1000;
 }
 
-void printFileRevision(const FileManifestHeader &file, const ArchivedFileVersion &version) {
+/**
+ * Find the newest version of the file that was backed up at or before the given time, or -1 if there isn't one.
+ */
+int findVersionAtTime(const FileHistory &history, time_t time) {
+	// Revisions are compared with the time in whole seconds, so those made during that second count too
+	return history.findVersionAt((int64_t) time * 1000 + 999);
+}
+
+void appendFileRevision(std::string &output, const FileManifestHeader &file, const ArchivedFileVersion &version) {
 	time_t revisionTimestamp = archiveTimestampToUnix(version.timestamp);
 	string revisionTime = formatDateTime(revisionTimestamp, "%Y-%m-%d %H:%M:%S");
 	time_t lastModifiedTimestamp = archiveTimestampToUnix(version.sourceLastModified);
@@ -87,14 +110,15 @@ void printFileRevision(const FileManifestHeader &file, const ArchivedFileVersion
 		checksum = binStringToHex(string((char *) version.sourceChecksum, sizeof(version.sourceChecksum)));
 	}
 
-	printf("%.*s %" PRId64 " %.*s %.*s %.*s\n",
-		   (int) file.path.length(), file.path.data(),
-		   version.sourceLength,
-		   (int) revisionTime.length(), revisionTime.data(),
-		   (int) lastModifiedTime.length(), lastModifiedTime.data(),
-		   (int) checksum.length(),
-		   checksum.data()
-	);
+	char sourceLength[24];
+
+	snprintf(sourceLength, sizeof(sourceLength), "%" PRId64, version.sourceLength);
+
+	output.append(file.path).append(" ")
+		.append(sourceLength).append(" ")
+		.append(revisionTime).append(" ")
+		.append(lastModifiedTime).append(" ")
+		.append(checksum).append("\n");
 }
 
 enum class FileListDetailLevel {
@@ -107,20 +131,18 @@ enum class TimeMode {
 	all
 };
 
-void listBackupFiles(BackupArchive &archive, BackupArchive::iterator &begin, BackupArchive::iterator &end,
+/**
+ * List the matching files, decrypting paths (and fetching histories for detailed listings) on "jobs" worker threads.
+ * The output is still in manifest order.
+ */
+void listBackupFiles(BackupArchive &archive, FilenameMatchMode matchMode, const std::string &matchString, const PathFilter *filter, int jobs,
 					 FileListDetailLevel detailLevel, bool includeDeleted, TimeMode timeMode, time_t atTime) {
-	while (begin != end) {
-		FileManifestHeader file = *begin;
-		++begin;
-
+	auto process = [detailLevel, includeDeleted, timeMode, atTime](FileManifestHeader &file, FileHistory *history, FileBatchOutput &result) {
 		if (detailLevel == FileListDetailLevel::basic) {
 			// Just printing all filenames, we don't even need to fetch the history to see if the file was deleted or not
-			printf(
-				"%.*s\n",
-				(int) file.path.length(), file.path.data()
-			);
-		} else if (file.hasHistory()) {
-			FileHistory fileHistory = archive.getFileHistory(file);
+			result.output.append(file.path).append("\n");
+		} else if (history) {
+			FileHistory &fileHistory = *history;
 
 			if (!fileHistory.versions.empty()) {
 				int i;
@@ -128,25 +150,20 @@ void listBackupFiles(BackupArchive &archive, BackupArchive::iterator &begin, Bac
 				switch (timeMode) {
 					case TimeMode::all:
 						for (auto & revision : fileHistory.versions) {
-							printFileRevision(file, revision);
+							appendFileRevision(result.output, file, revision);
 						}
 						break;
 					case TimeMode::latest:
 						if (includeDeleted || !fileHistory.versions.back().isDeleted()) {
-							printFileRevision(file, fileHistory.versions.back());
+							appendFileRevision(result.output, file, fileHistory.versions.back());
 						}
 						break;
 
 					case TimeMode::atTime:
-						for (i = 0; i < fileHistory.versions.size(); i++) {
-							if (archiveTimestampToUnix(fileHistory.versions[i].timestamp) > atTime) {
-								// This snapshot is newer than the one we want to see
-								break;
-							}
-						}
+						i = findVersionAtTime(fileHistory, atTime);
 
-						if (i > 0 && (includeDeleted || !fileHistory.versions[i - 1].isDeleted())) {
-							printFileRevision(file, fileHistory.versions[i - 1]);
+						if (i >= 0 && (includeDeleted || !fileHistory.versions[i].isDeleted())) {
+							appendFileRevision(result.output, file, fileHistory.versions[i]);
 						}
 
 						break;
@@ -154,105 +171,129 @@ void listBackupFiles(BackupArchive &archive, BackupArchive::iterator &begin, Bac
 			}
 		} else {
 			// Not sure why this would happen unless database is corrupt (special files-that-arent-files as flags?)
-			cerr << "Error: No revision history found for '" << file.path << "'" << endl;
+			result.errors.append("Error: No revision history found for '").append(file.path).append("'\n");
 		}
-	}
-}
+	};
 
-void readFileRevisionData(const BackupArchive &archive,
-						  const FileManifestHeader &file, const ArchivedFileVersion &version,
-						  const vector<int64_t> &blockList,
-						  CryptoPP::BufferedTransformation &output) {
-	CryptoPP::Weak::MD5 hasher;
+	auto emit = [](const FileBatchOutput &result) {
+		if (!result.errors.empty()) {
+			// Keep errors in their proper place relative to the listing
+			fflush(stdout);
+			fwrite(result.errors.data(), 1, result.errors.length(), stderr);
+		}
 
-	bool hasCorruptBlocks = false;
+		fwrite(result.output.data(), 1, result.output.length(), stdout);
+	};
 
-	for (int64_t blockNumber : blockList) {
-		DataBlock block = archive.blockDirectories.readBlockHeader(blockNumber);
-		std::string archivedData = archive.blockDirectories.readBlockData(blockNumber, block.backupLen);
+	archive.forEachFile(matchMode, matchString, filter, jobs, detailLevel != FileListDetailLevel::basic, process, emit);
+}
 
-		std::string decryptedData;
+/**
+ * Write a decoded block to the output, returning false if the block turned out to be corrupt.
+ */
+static bool putDecodedBlock(CryptoPP::BufferedTransformation &output, BlockDecodeStatus status, int sourceLen, boost::string_view plaintext) {
+	if (status == BlockDecodeStatus::badArchivedMD5) {
+		/*
+		 * Since we daren't decrypt or decompress this block, replace its position in the file with a string
+		 * of nul bytes of the same original length:
+		 */
+		int bytesToPad = sourceLen;
+		const int PADDING_BUFFER_SIZE = 16 * 1024;
+		auto padding = new uint8_t[PADDING_BUFFER_SIZE](); // Zero-initialised by the ()
 
-		uint8_t cipher = block.getCipher();
+		while (bytesToPad > 0) {
+			int padThisLoop = bytesToPad < PADDING_BUFFER_SIZE ? bytesToPad : PADDING_BUFFER_SIZE;
 
-		if (block.isEncrypted() || block.isCompressed()) {
-			// Check that the archived block isn't corrupt before we try something interesting like decryption or decompression
+			output.Put((const CryptoPP::byte *) padding, padThisLoop);
 
-			CryptoPP::byte archivedHash[CryptoPP::Weak::MD5::DIGESTSIZE];
-			hasher.Update((const CryptoPP::byte*) archivedData.data(), archivedData.length());
-			hasher.Final(archivedHash);
+			bytesToPad -= padThisLoop;
+		}
 
-			if (memcmp(archivedHash, block.backupMD5, sizeof(archivedHash)) != 0) {
-				/*
-				 * Since we daren't decrypt or decompress this block, replace its position in the file with a string
-				 * of nul bytes of the same original length:
-				 */
-				int bytesToPad = block.sourceLen;
-				const int PADDING_BUFFER_SIZE = 16 * 1024;
-				auto padding = new uint8_t[PADDING_BUFFER_SIZE](); // Zero-initialised by the ()
+		delete [] padding;
 
-				while (bytesToPad > 0) {
-					int padThisLoop = bytesToPad < PADDING_BUFFER_SIZE ? bytesToPad : PADDING_BUFFER_SIZE;
+		return false;
+	}
 
-					output.Put((const CryptoPP::byte *) padding, padThisLoop);
+	// Finally write it to the destination
+	output.Put((const CryptoPP::byte *) plaintext.data(), plaintext.length());
 
-					bytesToPad -= padThisLoop;
-				}
+	return status == BlockDecodeStatus::ok;
+}
+
+/**
+ * Decode the blocks of a file revision to the output. If a batch is supplied, the blocks are taken from it (it must
+ * have already been fetched), otherwise they're taken from the cache if possible, or else read from the archive now.
+ *
+ * Blocks read from the archive now are decoded on the decode pool if one is supplied (and the file has enough blocks
+ * to be worth it), with the blocks read ahead of the one being written taken from readAheadBudget.
+ */
+void readFileRevisionData(const BackupArchive &archive,
+						  const FileManifestHeader &file, const ArchivedFileVersion &version,
+						  const vector<int64_t> &blockList,
+						  CryptoPP::BufferedTransformation &output,
+						  const RestoreBatch *batch = nullptr,
+						  DecodedBlockCache *cache = nullptr,
+						  boost::asio::thread_pool *decodePool = nullptr,
+						  ReadAheadBudget *readAheadBudget = nullptr) {
+	// Handing the blocks of a small file to the decode pool would cost more than it saves:
+	const size_t MIN_PIPELINED_BLOCKS = 8;
 
-				delete [] padding;
+	bool hasCorruptBlocks = false;
 
-				hasCorruptBlocks = true;
+	if (batch) {
+		for (int64_t blockNumber : blockList) {
+			const DecodedBlock &block = batch->getBlock(blockNumber);
 
-				continue;
+			if (!block.error.empty()) {
+				throw std::runtime_error(block.error);
 			}
+
+			hasCorruptBlocks |= !putDecodedBlock(output, block.status, block.sourceLen, block.data);
 		}
+	} else if (decodePool && readAheadBudget && blockList.size() >= MIN_PIPELINED_BLOCKS) {
+		PipelinedBlockDecoder decoder(archive, blockList, *decodePool, *readAheadBudget, cache);
 
-		retryDecrypt:
+		// The blocks are written (and so hashed) in order here, while the pool decodes the ones after them
+		while (decoder.hasNext()) {
+			std::shared_ptr<const DecodedBlock> block = decoder.next();
 
-		if (block.isEncrypted() && isValidCipherCode(cipher)) {
-			try {
-				archivedData = code42Ciphers[cipher]->decrypt(archivedData, archive.key);
-			} catch (BadPaddingException & e) {
-				if (cipher == CIPHER_CODE_BLOWFISH_448) {
-					cipher = CIPHER_CODE_BLOWFISH_128;
-					goto retryDecrypt;
-				}
-				throw;
+			if (!block->error.empty()) {
+				throw std::runtime_error(block->error);
 			}
-		}
 
-		if (block.isCompressed()) {
-			try {
-				archivedData = maybeDecompress(archivedData);
-			} catch (std::exception & e) {
-				if (block.type != DATA_BLOCK_TYPE_UNKNOWN) {
-					throw;
-				}
+			hasCorruptBlocks |= !putDecodedBlock(output, block->status, block->sourceLen, block->data);
+		}
+	} else {
+		// Fetches each block's header and data together, merging reads of neighbouring blocks
+		BlockReader reader(archive.blockDirectories, blockList);
+		BlockDecoder decoder(archive.key);
 
-				/* If the "compressed" MD5 is the same as the source MD5, it was never compressed in the first
-				 * place and we can just pass it through.
-				 */
-				CryptoPP::byte compressedHash[CryptoPP::Weak::MD5::DIGESTSIZE];
-				hasher.Update((const CryptoPP::byte*) archivedData.data(), archivedData.length());
-				hasher.Final(compressedHash);
+		for (size_t blockIndex = 0; blockIndex < blockList.size(); blockIndex++) {
+			if (cache) {
+				std::shared_ptr<const DecodedBlock> cached = cache->find(blockList[blockIndex]);
 
-				if (memcmp(compressedHash, block.sourceMD5, sizeof(compressedHash)) != 0) {
-					throw;
+				if (cached) {
+					putDecodedBlock(output, cached->status, cached->sourceLen, cached->data);
+					continue;
 				}
 			}
-		}
 
-		// Check that the hash of the restored block is the same as what it was raw on disk when first backed up
-		CryptoPP::byte restoredHash[CryptoPP::Weak::MD5::DIGESTSIZE];
-		hasher.Update((const CryptoPP::byte*) archivedData.data(), archivedData.length());
-		hasher.Final(restoredHash);
+			boost::string_view archivedData, plaintext;
+			DataBlock block = reader.read(blockIndex, archivedData);
+			BlockDecodeStatus status = decoder.decode(block, archivedData, plaintext);
 
-		if (memcmp(restoredHash, block.sourceMD5, sizeof(restoredHash)) != 0) {
-			hasCorruptBlocks = true;
-		}
+			hasCorruptBlocks |= !putDecodedBlock(output, status, block.sourceLen, plaintext);
 
-		// Finally write it to the destination
-		output.Put((const CryptoPP::byte *) archivedData.data(), archivedData.length());
+			if (cache && status == BlockDecodeStatus::ok) {
+				std::shared_ptr<DecodedBlock> decoded = std::make_shared<DecodedBlock>();
+
+				decoded->status = status;
+				decoded->sourceLen = block.sourceLen;
+				decoded->data.assign(plaintext.data(), plaintext.length());
+
+				cache->insert(blockList[blockIndex], decoded);
+			}
+		}
 	}
 
 	if (hasCorruptBlocks) {
@@ -260,12 +301,59 @@ void readFileRevisionData(const BackupArchive &archive,
 	}
 }
 
+/**
+ * The lines reported while restoring some files. They're held until the files before them have been reported, so files
+ * restored by worker threads are still reported in manifest order, and each line is written out whole.
+ */
+class RestoreReport {
+private:
+	// Lines for stderr are marked true:
+	std::vector<std::pair<bool, std::string>> lines;
+
+public:
+	bool success;
+
+	RestoreReport() : success(true) {
+	}
+
+	void output(const std::string &line) {
+		lines.emplace_back(false, line + "\n");
+	}
+
+	void error(const std::string &line) {
+		lines.emplace_back(true, line + "\n");
+	}
+
+	/**
+	 * Write out the lines reported so far, in the order they were reported.
+	 */
+	void flush() {
+		for (auto &line : lines) {
+			if (line.first) {
+				// Keep errors in their proper place relative to the output
+				fflush(stdout);
+				fwrite(line.second.data(), 1, line.second.length(), stderr);
+			} else {
+				fwrite(line.second.data(), 1, line.second.length(), stdout);
+			}
+		}
+
+		fflush(stdout);
+		lines.clear();
+	}
+};
+
 void restoreFileRevision(const BackupArchive &archive,
 						 const FileManifestHeader &file, const ArchivedFileVersion &version,
 						 const BlockList &blockList,
 						 const boost::filesystem::path &destDirectory,
+						 RestoreReport &report,
 						 bool dryRun = true,
-                         bool destSupportsColons = true) {
+                         bool destSupportsColons = true,
+                         const RestoreBatch *batch = nullptr,
+                         DecodedBlockCache *cache = nullptr,
+                         boost::asio::thread_pool *decodePool = nullptr,
+                         ReadAheadBudget *readAheadBudget = nullptr) {
     boost::filesystem::path destFilename;
 
     if (destSupportsColons) {
@@ -283,7 +371,14 @@ void restoreFileRevision(const BackupArchive &archive,
     }
     
 	if (!dryRun) {
-		boost::filesystem::create_directories(destFilename.parent_path());
+		boost::system::error_code err;
+
+		// Another worker can be creating the same directories at the same time, which is fine
+		boost::filesystem::create_directories(destFilename.parent_path(), err);
+
+		if (err && !boost::filesystem::is_directory(destFilename.parent_path())) {
+			throw boost::filesystem::filesystem_error("Failed to create output directory", destFilename.parent_path(), err);
+		}
 	}
 
 	if (version.isRegularFile()) {
@@ -293,7 +388,8 @@ void restoreFileRevision(const BackupArchive &archive,
 		CryptoPP::Weak::MD5 md5Hasher;
 		CryptoPP::HashFilter hashFilter(md5Hasher, new CryptoPP::StringSink(fileMD5));
 
-		CryptoPP::FileSink *outputSink = nullptr;
+		// Owned here so the output file is closed even if the restore fails part-way through:
+		std::unique_ptr<CryptoPP::FileSink> outputSink;
 
 		CryptoPP::ChannelSwitch cs;
 
@@ -302,18 +398,16 @@ void restoreFileRevision(const BackupArchive &archive,
 
 		// And written to a file if this isn't a dry run:
 		if (!dryRun) {
-			outputSink = new CryptoPP::FileSink(tempFilename.c_str(), true);
+			outputSink.reset(new CryptoPP::FileSink(tempFilename.c_str(), true));
 			cs.AddDefaultRoute(*outputSink);
 		}
 
 		// Do the restore now:
-		readFileRevisionData(archive, file, version, blockList, cs);
+		readFileRevisionData(archive, file, version, blockList, cs, batch, cache, decodePool, readAheadBudget);
 
 		cs.MessageEnd();
 
-		if (!dryRun) {
-			delete outputSink;
-		}
+		outputSink.reset();
 
 		// Now we need to turn that temporary file into the destination file:
 
@@ -362,7 +456,7 @@ void restoreFileRevision(const BackupArchive &archive,
 		std::string symlinkContents;
 		StringSink sink(symlinkContents);
 
-		readFileRevisionData(archive, file, version, blockList, sink);
+		readFileRevisionData(archive, file, version, blockList, sink, batch, cache, decodePool, readAheadBudget);
 
 		if (!dryRun) {
 			try {
@@ -390,12 +484,12 @@ void restoreFileRevision(const BackupArchive &archive,
 		try {
 			boost::filesystem::last_write_time(destFilename, archiveTimestampToUnix(version.sourceLastModified));
 		} catch (boost::filesystem::filesystem_error &e) {
-			std::cerr << "Failed to update timestamp of '" << destFilename.string() << "': " << e.what() << std::endl;
+			report.error("Failed to update timestamp of '" + destFilename.string() + "': " + e.what());
 		}
 	}
 
 	// Successfully restored this file
-	cout << file.path << endl;
+	report.output(file.path);
 }
 
 static bool directorySupportsColons(const boost::filesystem::path &path) {
@@ -425,55 +519,672 @@ static bool directorySupportsColons(const boost::filesystem::path &path) {
     return true;
 }
 
+class PendingRestore {
+public:
+	FileManifestHeader file;
+	ArchivedFileVersion version;
+	BlockList blockList;
+
+	// If the revision to restore couldn't be found, why not (it's reported in the file's place instead):
+	std::string error;
+};
+
+/**
+ * Some file revisions for a worker to restore, either a batch whose blocks are fetched together in archive order, or a
+ * single revision that's too large for a batch, whose blocks are read as it's restored.
+ */
+class RestoreTask {
+public:
+	std::vector<PendingRestore> files;
+	bool batched;
+
+	// The size of the blocks the batch holds in memory until it's done, or for a single revision, of the blocks it reads
+	// ahead of the one being written:
+	int64_t memoryBytes;
+
+	RestoreTask() : batched(true), memoryBytes(0) {
+	}
+};
+
+/**
+ * Estimate the memory used by the blocks of a revision restored on its own, which are read up to readAheadBlocks
+ * ahead of the one being written, from its average block size.
+ */
+static int64_t estimateReadAheadBytes(const PendingRestore &restore, size_t readAheadBlocks) {
+	if (restore.blockList.empty()) {
+		return 0;
+	}
+
+	int64_t averageBlockBytes = (restore.version.sourceLength + (int64_t) restore.blockList.size() - 1) / (int64_t) restore.blockList.size();
+
+	return averageBlockBytes * (int64_t) std::min(restore.blockList.size(), std::max(readAheadBlocks, (size_t) 1));
+}
+
+/**
+ * Restore the revisions of the task. The blocks of a revision restored on its own are decoded on the decode pool (if
+ * supplied).
+ */
+static RestoreReport runRestoreTask(const BackupArchive &archive, const RestoreTask &task, const boost::filesystem::path &destDirectory,
+									bool dryRun, bool destSupportsColons, DecodedBlockCache *cache,
+									boost::asio::thread_pool *decodePool, ReadAheadBudget *readAheadBudget) {
+	RestoreReport report;
+	RestoreBatch batch(archive, cache);
+
+	if (task.batched) {
+		for (auto &restore : task.files) {
+			if (restore.error.empty()) {
+				batch.add(restore.blockList, restore.version.sourceLength);
+			}
+		}
+
+		batch.fetch();
+	}
+
+	for (auto &restore : task.files) {
+		if (!restore.error.empty()) {
+			report.success = false;
+			report.error(restore.error);
+			continue;
+		}
+
+		try {
+			restoreFileRevision(archive, restore.file, restore.version, restore.blockList, destDirectory, report, dryRun, destSupportsColons,
+				task.batched ? &batch : nullptr, cache, task.batched ? nullptr : decodePool, readAheadBudget);
+		} catch (std::exception &e) {
+			report.success = false;
+			report.error("Error: Failures occurred while restoring '" + restore.file.path + "': " + e.what());
+		}
+	}
+
+	return report;
+}
+
+/**
+ * Restore the matched files on "jobs" worker threads, while this thread finds the revisions to restore. Files are
+ * still reported in manifest order.
+ *
+ * Unless batchBytes is zero, file revisions are collected into batches of up to that much file data so their blocks
+ * can be read in archive order. Revisions too large to fit in a batch are restored one at a time. The batches being
+ * restored at once, along with the blocks read ahead for the revisions restored on their own, are limited to
+ * memoryBytes in total, so each worker's batches are limited to its share of that.
+ *
+ * Decoded blocks are kept in the cache (if supplied) so that blocks shared between files are only decoded once.
+ */
 bool restoreBackupFiles(BackupArchive &archive, BackupArchive::iterator &begin, BackupArchive::iterator &end,
 						const boost::filesystem::path &destDirectory,
 						bool includeDeleted, TimeMode timeMode, time_t atTime,
 						bool dryRun = true,
-                        bool destSupportsColons = true) {
+                        bool destSupportsColons = true,
+                        int64_t batchBytes = 0,
+                        DecodedBlockCache *cache = nullptr,
+                        int jobs = 1,
+                        int64_t memoryBytes = 0) {
 	bool success = true;
 
-	// For every matched file in the manifest:
-	while (begin != end) {
-		FileManifestHeader file = *begin;
-		++begin;
+	// How many upcoming files have their histories loaded together:
+	const size_t HISTORY_WINDOW = 256;
+
+	jobs = std::max(jobs, 1);
+
+	if (memoryBytes > 0 && batchBytes > 0) {
+		batchBytes = std::max(std::min(batchBytes, memoryBytes / jobs), (int64_t) 1);
+	}
+
+	// Limit how many tasks can be finished but waiting for an earlier task to be reported
+	const size_t maxTasksInFlight = (size_t) jobs * 4;
+
+	// Revisions too large for a batch have their blocks decoded by a pool of their own, so that a single large file
+	// still uses every worker. Limit how many blocks those files have read ahead of their decoded blocks between them:
+	const size_t maxBlocksInFlight = (size_t) jobs * 4;
+
+	ReadAheadBudget readAheadBudget(maxBlocksInFlight);
+
+	std::unique_ptr<boost::asio::thread_pool> decodePool;
+
+	if (jobs > 1) {
+		decodePool.reset(new boost::asio::thread_pool(jobs));
+	}
+
+	boost::asio::thread_pool pool(jobs);
+	std::deque<std::pair<std::future<RestoreReport>, int64_t>> inFlight;
+	int64_t inFlightBytes = 0;
+
+	auto reportOldest = [&inFlight, &inFlightBytes, &success]() {
+		RestoreReport report = inFlight.front().first.get();
+
+		inFlightBytes -= inFlight.front().second;
+		inFlight.pop_front();
+
+		success = report.success && success;
+		report.flush();
+	};
+
+	auto submit = [&](RestoreTask &task) {
+		// Wait for earlier tasks to finish if this one would take us over the memory limit (but always run at least one)
+		while (!inFlight.empty() && (inFlight.size() >= maxTasksInFlight || (memoryBytes > 0 && inFlightBytes + task.memoryBytes > memoryBytes))) {
+			reportOldest();
+		}
+
+		auto pending = std::make_shared<RestoreTask>(std::move(task));
+		auto packaged = std::make_shared<std::packaged_task<RestoreReport()>>(
+			[&archive, pending, &destDirectory, dryRun, destSupportsColons, cache, &decodePool, &readAheadBudget]() {
+				return runRestoreTask(archive, *pending, destDirectory, dryRun, destSupportsColons, cache, decodePool.get(), &readAheadBudget);
+			}
+		);
+
+		inFlight.emplace_back(packaged->get_future(), pending->memoryBytes);
+		inFlightBytes += pending->memoryBytes;
+
+		boost::asio::post(pool, [packaged]() {
+			(*packaged)();
+		});
+
+		task = RestoreTask();
+	};
+
+	RestoreTask current;
+
+	FileHistoryBatch histories(archive);
+	std::vector<FileManifestHeader> window;
+
+	try {
+		while (begin != end) {
+			// If reading the manifest fails, the files before that point are still restored before the error is passed on
+			std::exception_ptr manifestError;
+
+			window.clear();
+			histories.clear();
 
-		if (file.hasHistory()) {
 			try {
-				FileHistory fileHistory = archive.getFileHistory(file);
+				for (; begin != end && window.size() < HISTORY_WINDOW; ++begin) {
+					window.push_back(*begin);
 
-				FileHistorySnapshot previous;
-				FileHistorySnapshot previousNotDeleted;
-				bool hasPrevious = false;
-				bool hasPreviousNotDeleted = false;
+					if (begin->hasHistory()) {
+						histories.add(*begin);
+					}
+				}
+			} catch (...) {
+				manifestError = std::current_exception();
+			}
 
-				// Locate the revision we want to restore:
-				for (auto iterator = fileHistory.begin(); iterator != fileHistory.end(); ++iterator) {
-					if (timeMode == TimeMode::atTime && archiveTimestampToUnix(iterator->version.timestamp) > atTime) {
-						break;
+			histories.fetch();
+
+			size_t historyIndex = 0;
+
+			// For every matched file in the window:
+			for (const FileManifestHeader &file : window) {
+				PendingRestore restore;
+				bool found = false;
+
+				restore.file = file;
+
+				if (file.hasHistory()) {
+					try {
+						FileHistory &fileHistory = histories.get(historyIndex++);
+
+						// Locate the revision we want to restore:
+						int target = timeMode == TimeMode::atTime ? findVersionAtTime(fileHistory, atTime) : (int) fileHistory.versions.size() - 1;
+
+						if (includeDeleted) {
+							// Restore the file as it was before it was deleted
+							while (target >= 0 && fileHistory.versions[target].isDeleted()) {
+								target--;
+							}
+						}
+
+						if (target >= 0 && !fileHistory.versions[target].isDeleted()) {
+							restore.version = fileHistory.versions[target];
+							fileHistory.resolveBlockList(target, restore.blockList);
+							found = true;
+						}
+					} catch (std::exception &e) {
+						restore.error = "Error: Failures occurred while restoring '" + file.path + "': " + e.what();
+					}
+				} else {
+					// Not sure why this would happen unless database is corrupt (special files-that-aren't-files as flags?)
+					restore.error = "Error: No revision history found for '" + file.path + "'";
+				}
+
+				if (found && (batchBytes <= 0 || restore.version.sourceLength > batchBytes)) {
+					// Keep the output in manifest order by submitting the files queued before this one first
+					if (!current.files.empty()) {
+						submit(current);
 					}
 
-					previous = *iterator;
-					hasPrevious = true;
+					RestoreTask single;
 
-					if (!iterator->version.isDeleted()) {
-						previousNotDeleted = *iterator;
-						hasPreviousNotDeleted = true;
+					single.batched = false;
+					// Without a decode pool, its blocks are read one at a time. With one, it could have the whole budget
+					single.memoryBytes = estimateReadAheadBytes(restore, decodePool ? maxBlocksInFlight : 1);
+					single.files.push_back(std::move(restore));
+
+					submit(single);
+				} else if (found || !restore.error.empty()) {
+					if (found) {
+						current.memoryBytes += restore.version.sourceLength;
+					}
+
+					current.files.push_back(std::move(restore));
+
+					if (current.memoryBytes >= batchBytes) {
+						submit(current);
 					}
 				}
+			}
 
-				if (includeDeleted && hasPreviousNotDeleted) {
-					restoreFileRevision(archive, file, previousNotDeleted.version, previousNotDeleted.blockList, destDirectory, dryRun, destSupportsColons);
-				} else if (hasPrevious && !previous.version.isDeleted()) {
-					restoreFileRevision(archive, file, previous.version, previous.blockList, destDirectory, dryRun, destSupportsColons);
+			if (manifestError) {
+				if (!current.files.empty()) {
+					submit(current);
 				}
-			} catch (std::exception &e) {
-				success = false;
-				cerr << "Error: Failures occurred while restoring '" << file.path << "': " << e.what() << endl;
+
+				while (!inFlight.empty()) {
+					reportOldest();
+				}
+
+				std::rethrow_exception(manifestError);
+			}
+		}
+
+		if (!current.files.empty()) {
+			submit(current);
+		}
+
+		while (!inFlight.empty()) {
+			reportOldest();
+		}
+	} catch (...) {
+		// Let the workers finish up before their captures go out of scope
+		pool.join();
+		throw;
+	}
+
+	pool.join();
+
+	return success;
+}
+
+/**
+ * Check the integrity of every block in the archive, scanning one block directory per worker. Corrupt blocks, and block
+ * directories that couldn't be checked at all, are printed to stdout. Returns false if any were found.
+ */
+bool verifyArchiveBlocks(const BackupArchive &archive, int jobs) {
+	const auto &directories = archive.blockDirectories.getDirectories();
+
+	boost::asio::thread_pool pool(jobs);
+
+	std::mutex outputMutex;
+	uint64_t blocksChecked = 0, corruptBlocks = 0, unreadableDirectories = 0;
+
+	for (auto &directory : directories) {
+		const BlockManifest *manifest = directory.get();
+
+		boost::asio::post(pool, [&archive, manifest, &outputMutex, &blocksChecked, &corruptBlocks, &unreadableDirectories]() {
+			BlockVerifyResult result = verifyBlockDirectory(archive.blockDirectories, *manifest, archive.key);
+
+			std::lock_guard<std::mutex> lock(outputMutex);
+
+			if (!result.directoryError.empty()) {
+				cout << manifest->directoryPath.string() << ": " << result.directoryError << endl;
+				unreadableDirectories++;
+			}
+
+			for (auto &corrupt : result.corruptBlocks) {
+				cout << corrupt.blockNumber << " " << manifest->directoryPath.filename().string() << ": " << corrupt.problem << endl;
+			}
+
+			blocksChecked += result.blocksChecked;
+			corruptBlocks += result.corruptBlocks.size();
+		});
+	}
+
+	pool.join();
+
+	cerr << "Checked " << blocksChecked << " blocks in " << directories.size() << " block directories, "
+		<< corruptBlocks << " corrupt";
+
+	if (unreadableDirectories > 0) {
+		cerr << ", " << unreadableDirectories << " block directories couldn't be read";
+	}
+
+	cerr << endl;
+
+	return corruptBlocks == 0 && unreadableDirectories == 0;
+}
+
+/**
+ * Get the path truncated to its first "depth" levels of directories (e.g. "/Users/dave" for depth 2).
+ */
+static std::string pathPrefix(const std::string &path, int depth) {
+	size_t end = 0;
+
+	for (int level = 0; level <= depth; level++) {
+		end = path.find('/', end + (level > 0 ? 1 : 0));
+
+		if (end == std::string::npos) {
+			return path;
+		}
+	}
+
+	return path.substr(0, end);
+}
+
+class SpaceUsage {
+public:
+	int64_t uniqueBytes;
+	int64_t sharedBytes;
+
+	SpaceUsage() : uniqueBytes(0), sharedBytes(0) {
+	}
+};
+
+/**
+ * Charge a block to the groups that refer to it: it's unique to a group if nothing outside that group refers to it.
+ */
+template <typename K>
+static void chargeBlock(std::map<K, SpaceUsage> &usage, std::vector<K> &groups, bool referencedElsewhere, int64_t size) {
+	std::sort(groups.begin(), groups.end());
+	groups.erase(std::unique(groups.begin(), groups.end()), groups.end());
+
+	for (auto &group : groups) {
+		if (groups.size() == 1 && !referencedElsewhere) {
+			usage[group].uniqueBytes += size;
+		} else {
+			usage[group].sharedBytes += size;
+		}
+	}
+}
+
+/**
+ * Report the storage used by the matched files, grouped by path prefix and by snapshot (the time the revisions were
+ * backed up, as listed by list-snapshots). Blocks shared with files outside the match count as shared.
+ */
+void printSpaceUsage(BackupArchive &archive, const BlockReferenceIndex &index,
+					 FilenameMatchMode matchMode, const std::string &matchString, const PathFilter *filter, int depth) {
+	const uint32_t NO_GROUP = UINT32_MAX;
+
+	std::vector<std::string> prefixes;
+	std::map<std::string, uint32_t> prefixIds;
+	std::vector<uint32_t> fileGroups;
+
+	auto begin = archive.begin(FilenameMatchMode::none, "");
+	auto end = archive.end();
+
+	for (; begin != end; ++begin) {
+		const FileManifestHeader &file = *begin;
+
+		if (filenameMatches(file.path, matchMode, matchString) && (!filter || filter->matches(file.path))) {
+			auto inserted = prefixIds.emplace(pathPrefix(file.path, depth), (uint32_t) prefixes.size());
+
+			if (inserted.second) {
+				prefixes.push_back(inserted.first->first);
 			}
+
+			fileGroups.push_back(inserted.first->second);
 		} else {
-			// Not sure why this would happen unless database is corrupt (special files-that-aren't-files as flags?)
+			fileGroups.push_back(NO_GROUP);
+		}
+	}
+
+	std::map<uint32_t, SpaceUsage> prefixUsage;
+	std::map<int64_t, SpaceUsage> snapshotUsage;
+	std::vector<uint32_t> groups;
+	std::vector<int64_t> snapshots;
+
+	const BlockManifest *sizesManifest = nullptr;
+	std::vector<uint32_t> sizes;
+	int64_t missingBlocks = 0;
+
+	// Space in the block data files that isn't held by any live block:
+	std::set<const BlockManifest*> measuredManifests;
+	int64_t unusedBytes = 0;
+
+	index.forEachBlock([&](int64_t blockNumber, const std::vector<BlockReference> &references) {
+		int64_t size;
+
+		try {
+			BlockLocation location = archive.blockDirectories.locateBlock(blockNumber);
+
+			// Blocks arrive in number order, so we only need the sizes for one block directory at a time
+			if (location.manifest != sizesManifest) {
+				int64_t manifestUnusedBytes;
+
+				sizes = location.manifest->getStoredBlockSizes(manifestUnusedBytes);
+				sizesManifest = location.manifest;
+
+				if (measuredManifests.insert(sizesManifest).second) {
+					unusedBytes += manifestUnusedBytes;
+				}
+			}
+
+			size = sizes[blockNumber - location.manifest->firstBlockNum];
+		} catch (std::exception &e) {
+			missingBlocks++;
+			return;
+		}
+
+		bool referencedElsewhere = false;
+
+		groups.clear();
+		snapshots.clear();
+
+		for (auto &reference : references) {
+			uint32_t group = reference.fileIndex < fileGroups.size() ? fileGroups[reference.fileIndex] : NO_GROUP;
+
+			if (group == NO_GROUP) {
+				referencedElsewhere = true;
+			} else {
+				groups.push_back(group);
+				snapshots.push_back(reference.revisionTime);
+			}
+		}
+
+		chargeBlock(prefixUsage, groups, referencedElsewhere, size);
+		chargeBlock(snapshotUsage, snapshots, referencedElsewhere, size);
+	});
+
+	if (missingBlocks > 0) {
+		cerr << "Warning: " << missingBlocks << " referenced blocks are missing from the archive and weren't counted" << endl;
+	}
+
+	// Directories that none of the files refer to still take up space:
+	for (auto &directory : archive.blockDirectories.getDirectories()) {
+		if (measuredManifests.count(directory.get()) == 0) {
+			try {
+				int64_t manifestUnusedBytes;
+
+				directory->getStoredBlockSizes(manifestUnusedBytes);
+				unusedBytes += manifestUnusedBytes;
+			} catch (std::exception &e) {
+			}
+		}
+	}
+
+	std::map<std::string, SpaceUsage> sortedPrefixUsage;
+
+	for (auto &usage : prefixUsage) {
+		sortedPrefixUsage[prefixes[usage.first]] = usage.second;
+	}
+
+	cerr << "Columns are: unique bytes, shared bytes, path prefix or snapshot time (then the bytes of the archive not held by any live block)" << endl;
+
+	for (auto &usage : sortedPrefixUsage) {
+		printf("prefix %" PRId64 " %" PRId64 " %.*s\n", usage.second.uniqueBytes, usage.second.sharedBytes,
+			(int) usage.first.length(), usage.first.data());
+	}
+
+	for (auto &usage : snapshotUsage) {
+		std::string time = formatDateTime(usage.first, "%Y-%m-%d %H:%M:%S");
+
+		printf("snapshot %" PRId64 " %" PRId64 " %s\n", usage.second.uniqueBytes, usage.second.sharedBytes, time.c_str());
+	}
+
+	printf("unused %" PRId64 "\n", unusedBytes);
+}
+
+/**
+ * List the times the archive was backed up at, along with how many files were changed and deleted at each time and
+ * the total size of the changed files.
+ */
+void printSnapshots(BackupArchive &archive, int jobs) {
+	SnapshotTimeline timeline(archive, jobs);
+
+	if (timeline.getUnreadableHistories() > 0) {
+		cerr << "Warning: The histories of " << timeline.getUnreadableHistories() << " files couldn't be read, so they aren't counted" << endl;
+	}
+
+	cerr << "Columns are: snapshot time, files changed, files deleted, bytes changed" << endl;
+
+	for (auto &snapshot : timeline.getSnapshots()) {
+		std::string time = formatDateTime(snapshot.time, "%Y-%m-%d %H:%M:%S");
+
+		printf("%s %" PRIu64 " %" PRIu64 " %" PRIu64 "\n", time.c_str(), snapshot.files, snapshot.deletedFiles, snapshot.changedBytes);
+	}
+}
+
+/**
+ * Decrypt every path in the file manifest, over and over for a few seconds, and print how many paths were decrypted
+ * per second. Every listing and restore that filters by path pays this for every file in the archive.
+ *
+ * This is measured both with the cached decryptors the ciphers normally use, and with a new decryptor constructed and
+ * keyed for every path (as was done before the cache existed).
+ */
+void benchmarkPathDecryption(BackupArchive &archive) {
+	const double MIN_SECONDS = 3;
+
+	FileManifestReader reader(archive.getFileIndexSources()[0].string());
+	FileManifestHeader header;
+	boost::string_view encryptedPath;
+
+	std::vector<std::string> encryptedPaths;
+
+	while (reader.next(header, encryptedPath)) {
+		encryptedPaths.emplace_back(encryptedPath.data(), encryptedPath.length());
+	}
+
+	if (encryptedPaths.empty()) {
+		cerr << "The archive has no files to decrypt the paths of" << endl;
+		return;
+	}
+
+	cerr << "Columns are: decryptors, paths decrypted, bytes of paths, seconds, paths per second" << endl;
+
+	for (bool caching : {true, false}) {
+		uint64_t decrypted = 0, pathBytes = 0;
+		double seconds = 0;
+
+		setDecryptorCaching(caching);
+
+		auto start = std::chrono::steady_clock::now();
+
+		while (seconds < MIN_SECONDS) {
+			for (auto &path : encryptedPaths) {
+				pathBytes += decryptEncryptedPath(path, archive.key).length();
+			}
+
+			decrypted += encryptedPaths.size();
+			seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		}
+
+		printf("%s %" PRIu64 " %" PRIu64 " %.3f %.0f\n", caching ? "cached" : "per-path", decrypted, pathBytes, seconds,
+			decrypted / seconds);
+	}
+
+	setDecryptorCaching(true);
+}
+
+/**
+ * Print the directory tree below the given path (or the whole archive), to the given depth, along with the number of
+ * files and their total size in each directory.
+ */
+bool printDirectoryTree(BackupArchive &archive, const std::string &path, int depth, bool includeDeleted) {
+	DirectoryTree tree(archive);
+	uint32_t start = DirectoryTree::ROOT;
+
+	if (!path.empty() && !tree.findPath(path, start)) {
+		cerr << "Path '" << path << "' was not found in the archive" << endl;
+		return false;
+	}
+
+	std::vector<DirectoryTreeTotals> totals = tree.getTotals(includeDeleted);
+
+	// Depth-first, so directories are followed by their contents:
+	std::vector<std::pair<uint32_t, int>> stack;
+
+	if (start == DirectoryTree::ROOT) {
+		const DirectoryTreeNode &root = tree.getNode(DirectoryTree::ROOT);
+
+		for (uint32_t i = root.childCount; i > 0; i--) {
+			stack.emplace_back(tree.getChild(DirectoryTree::ROOT, i - 1), 0);
+		}
+	} else {
+		stack.emplace_back(start, 0);
+	}
+
+	while (!stack.empty()) {
+		uint32_t nodeIndex = stack.back().first;
+		int level = stack.back().second;
+		const DirectoryTreeNode &node = tree.getNode(nodeIndex);
+
+		stack.pop_back();
+
+		if (totals[nodeIndex].files == 0 && !includeDeleted) {
+			continue;
+		}
+
+		std::string nodePath = tree.getPath(nodeIndex);
+
+		printf("%c %" PRIu64 " %" PRIu64 " %s\n", node.isDirectory() ? 'd' : 'f', totals[nodeIndex].files,
+			   totals[nodeIndex].bytes, nodePath.c_str());
+
+		if (level < depth) {
+			for (uint32_t i = node.childCount; i > 0; i--) {
+				stack.emplace_back(tree.getChild(nodeIndex, i - 1), level + 1);
+			}
+		}
+	}
+
+	return true;
+}
+
+/**
+ * Print the file revisions which refer to each of the given blocks.
+ */
+bool printBlockReferences(BackupArchive &archive, const BlockReferenceIndex &index, const std::vector<int64_t> &blockNumbers) {
+	std::vector<std::vector<BlockReference>> references;
+	std::map<uint32_t, std::string> paths;
+	bool success = true;
+
+	for (int64_t blockNumber : blockNumbers) {
+		references.push_back(index.find(blockNumber));
+
+		if (references.back().empty()) {
+			cerr << "Block " << blockNumber << " is not referenced by any file revision" << endl;
 			success = false;
-			cerr << "Error: No revision history found for '" << file.path << "'" << endl;
+		}
+
+		for (auto &reference : references.back()) {
+			paths[reference.fileIndex];
+		}
+	}
+
+	// Look up the paths of the files we need:
+	auto begin = archive.begin(FilenameMatchMode::none, "");
+	auto end = archive.end();
+
+	for (uint32_t fileIndex = 0; begin != end; ++begin, fileIndex++) {
+		auto found = paths.find(fileIndex);
+
+		if (found != paths.end()) {
+			found->second = begin->path;
+		}
+	}
+
+	for (size_t i = 0; i < blockNumbers.size(); i++) {
+		for (auto &reference : references[i]) {
+			std::string &path = paths[reference.fileIndex];
+			std::string revisionTime = formatDateTime(reference.revisionTime, "%Y-%m-%d %H:%M:%S");
+
+			printf("%" PRId64 " %.*s %s\n", blockNumbers[i], (int) path.length(), path.data(), revisionTime.c_str());
 		}
 	}
 
@@ -688,6 +1399,11 @@ int main(int argc, char **argv) {
 		("key", po::value<string>(), "your backup decryption key (Hexadecimal, not your password. Optional)")
         ("key64", po::value<string>(), "backup decryption key in base64 (76 characters long. Optional)")
 		("archive", po::value<string>(), "the root of your CrashPlan backup archive")
+		("mmap", "memory-map the archive's block data files instead of reading them (recommended for 64-bit systems)")
+		("max-open-files", po::value<int>(), "maximum number of block data files to hold open at once (default 128)")
+		("index-cache", po::value<string>(), "directory to keep decoded archive indexes in, to speed up later runs against the same archive (Optional)")
+		("path-catalog", "also keep a catalog of decrypted file paths in the index cache, to speed up --prefix and --filename (the catalog is not encrypted)")
+		("jobs", po::value<int>(), "number of worker threads to use (default: number of CPU cores)")
 
 		("command", po::value<string>(), "command to run (recover-key,list,restore,etc)")
 		;
@@ -696,6 +1412,9 @@ int main(int argc, char **argv) {
 	filterOptions.add_options()
 		("prefix", po::value<string>(), "prefix of the archived filepath to operate on")
 		("filename", po::value<string>(), "exact archived filepath to operate on")
+		("include", po::value<std::vector<string>>(), "glob pattern of archived filepaths to operate on, e.g. '/Users/*/Documents' (can be repeated)")
+		("exclude", po::value<std::vector<string>>(), "glob pattern of archived filepaths to skip, e.g. '*.tmp' or 'node_modules' (can be repeated)")
+		("filter-file", po::value<string>(), "file of --include patterns (one per line), with excludes marked by a '- ' prefix")
 
 		("include-deleted", "include deleted files")
 		("at", po::value<string>(), "restore/list files at the given date (yyyy-mm-dd hh:mm:ss), if omitted will use the newest version")
@@ -710,14 +1429,28 @@ int main(int argc, char **argv) {
 		 */
 		("dry-run", "verify integrity of restored files without actually writing them to disk. Filenames are printed to stdout and "
 		"errors to stderr.")
+		("batch-size", po::value<int>(), "amount of file data (in MB) to fetch at once, reading blocks in the order they're stored in the archive "
+		"rather than file by file (default 256, 0 to restore one file at a time)")
+		("block-cache", po::value<int>(), "amount of memory (in MB) to use for keeping decoded blocks, so blocks shared between "
+		"files and revisions are only decoded once (default 64, 0 to disable)")
+		("restore-memory", po::value<int>(), "amount of memory (in MB) that the batches being restored by the --jobs workers (and the "
+		"blocks read ahead for files too large for a batch) can use between them, each worker's batches are limited to its share "
+		"(default 1024, 0 for no limit)")
+		("stats", "print how many blocks were found in the block cache (hits) and had to be decoded (misses) once the restore is done")
 		;
 
 
+	po::options_description referenceOptions("Block reference options");
+	referenceOptions.add_options()
+		("depth", po::value<int>(), "number of directory levels to group paths by for du, or to show for tree (default 2)")
+		("block", po::value<std::vector<int64_t>>(), "block number to look up with find-block (can be repeated)")
+		;
+
 	po::positional_options_description positionalOptions;
 	positionalOptions.add("command", -1);
 
 	po::options_description allOptions;
-	allOptions.add(mainOptions).add(filterOptions).add(restoreOptions);
+	allOptions.add(mainOptions).add(filterOptions).add(restoreOptions).add(referenceOptions);
 
 	po::variables_map vm;
 
@@ -734,12 +1467,18 @@ int main(int argc, char **argv) {
 		cout << "Plan C" << endl;
 		cout << allOptions << endl;
 		cout << "Commands:" << endl;
-		cout << "  recover-key   - Recover your backup encryption key from a CrashPlan ADB directory or cp.properties file" << endl;
-		cout << "  derive-key    - Derive an encryption key from an archive password" << endl;
-		cout << "  list          - List all filenames that were ever in the backup (incl deleted)" << endl;
-		cout << "  list-detailed - List the newest version of files in the backup (add --at for other times)" << endl;
-		cout << "  list-all      - List all versions of the files in the backup" << endl;
-		cout << "  restore       - Restore files" << endl;
+		cout << "  recover-key    - Recover your backup encryption key from a CrashPlan ADB directory or cp.properties file" << endl;
+		cout << "  derive-key     - Derive an encryption key from an archive password" << endl;
+		cout << "  list           - List all filenames that were ever in the backup (incl deleted)" << endl;
+		cout << "  list-detailed  - List the newest version of files in the backup (add --at for other times)" << endl;
+		cout << "  list-all       - List all versions of the files in the backup" << endl;
+		cout << "  restore        - Restore files" << endl;
+		cout << "  verify-blocks  - Check the integrity of every block in the archive (decryption key optional)" << endl;
+		cout << "  du             - Show the unique and shared storage used by each path prefix and snapshot" << endl;
+		cout << "  find-block     - List the file revisions which refer to the given --block numbers" << endl;
+		cout << "  tree           - Show the directory tree with the number of files and bytes in each directory" << endl;
+		cout << "  list-snapshots - List the times the archive was backed up at, with the files changed (decryption key optional)" << endl;
+		cout << "  bench-paths    - Measure how many file paths per second can be decrypted, with and without cached decryptors" << endl;
 		return EXIT_FAILURE;
 	}
 
@@ -748,6 +1487,7 @@ int main(int argc, char **argv) {
 
 	FilenameMatchMode matchMode = FilenameMatchMode::none;
 	string matchString;
+	PathFilter pathFilter;
 
 	if (vm.count("adb")) {
 		adbPath = vm["adb"].as<string>();
@@ -768,6 +1508,29 @@ int main(int argc, char **argv) {
 		matchMode = FilenameMatchMode::equals;
 	}
 
+	try {
+		if (vm.count("include")) {
+			for (auto &pattern : vm["include"].as<std::vector<string>>()) {
+				pathFilter.include(pattern);
+			}
+		}
+
+		if (vm.count("exclude")) {
+			for (auto &pattern : vm["exclude"].as<std::vector<string>>()) {
+				pathFilter.exclude(pattern);
+			}
+		}
+
+		if (vm.count("filter-file")) {
+			pathFilter.loadFile(vm["filter-file"].as<string>());
+		}
+	} catch (std::exception &e) {
+		cerr << e.what() << endl;
+		return EXIT_FAILURE;
+	}
+
+	const PathFilter *filter = pathFilter.empty() ? nullptr : &pathFilter;
+
 	if (vm.count("key")) {
 		key = hexStringToBin(vm["key"].as<string>());
 	}
@@ -776,7 +1539,10 @@ int main(int argc, char **argv) {
         key = base64Decode(vm["key64"].as<string>());
     }
 
-	if (adbPath.length() == 0) {
+	// Blocks can be verified without a key, so only look for one when asked to:
+	bool keyRequired = vm["command"].as<string>() != "verify-blocks" && vm["command"].as<string>() != "list-snapshots";
+
+	if (adbPath.length() == 0 && keyRequired) {
 		for (auto &path : {"/Library/Application Support/CrashPlan/conf/adb", "/usr/local/crashplan/conf/adb"}) {
 			if (boost::filesystem::is_directory(path)) {
 				adbPath = path; // Although we probably can't read this directory without being root
@@ -853,7 +1619,7 @@ int main(int argc, char **argv) {
 		key = recoverADBKey(adb);
 	}
 
-	if (key.length() == 0 && adbPath.length() == 0) {
+	if (key.length() == 0 && adbPath.length() == 0 && keyRequired) {
 		cerr << "Couldn't find your decryption key automatically, you must supply one of the --adb, --cpproperties, --key or --key64 options" << endl;
 		return EXIT_FAILURE;
 	}
@@ -865,7 +1631,10 @@ int main(int argc, char **argv) {
 	}
 
 	if (vm["command"].as<string>() == "list" || vm["command"].as<string>() == "list-detailed"
-			|| vm["command"].as<string>() == "list-all" || vm["command"].as<string>() == "restore") {
+			|| vm["command"].as<string>() == "list-all" || vm["command"].as<string>() == "restore"
+			|| vm["command"].as<string>() == "verify-blocks" || vm["command"].as<string>() == "du"
+			|| vm["command"].as<string>() == "find-block" || vm["command"].as<string>() == "tree"
+			|| vm["command"].as<string>() == "list-snapshots" || vm["command"].as<string>() == "bench-paths") {
 		if (!vm.count("archive")) {
 			cerr << "You must supply the --archive option" << endl;
 			return EXIT_FAILURE;
@@ -884,6 +1653,32 @@ int main(int argc, char **argv) {
 			return EXIT_FAILURE;
 		}
 
+		if (vm.count("index-cache")) {
+			try {
+				backupArchive->setIndexCacheDirectory(boost::filesystem::path(vm["index-cache"].as<string>()));
+			} catch (std::exception &e) {
+				cerr << "Fatal error opening index cache: " << e.what() << endl;
+				return EXIT_FAILURE;
+			}
+		}
+
+		if (vm.count("path-catalog")) {
+			if (!vm.count("index-cache")) {
+				cerr << "--path-catalog requires an --index-cache directory to keep the catalog in" << endl;
+				return EXIT_FAILURE;
+			}
+
+			backupArchive->setPathCatalogEnabled(true);
+		}
+
+		// Block manifests are loaded on demand, and only a limited number of block data files are kept open:
+		backupArchive->blockDirectories.setDataFileOptions(
+			vm.count("mmap") > 0,
+			vm.count("max-open-files") ? std::max(vm["max-open-files"].as<int>(), 1) : BlockDataFileCache::DEFAULT_MAX_OPEN_FILES
+		);
+
+		int jobs = vm.count("jobs") ? std::max(vm["jobs"].as<int>(), 1) : std::max((int) std::thread::hardware_concurrency(), 1);
+
 		if (vm["command"].as<string>() == "list" || vm["command"].as<string>() == "list-detailed"
 			|| vm["command"].as<string>() == "list-all") {
 
@@ -906,10 +1701,7 @@ int main(int argc, char **argv) {
 				timeMode = TimeMode::latest;
 			}
 
-			auto begin = backupArchive->begin(matchMode, matchString);
-			auto end = backupArchive->end();
-
-			listBackupFiles(*backupArchive, begin, end, detailLevel, includeDeleted, timeMode, at);
+			listBackupFiles(*backupArchive, matchMode, matchString, filter, jobs, detailLevel, includeDeleted, timeMode, at);
 
 			return EXIT_SUCCESS;
 		} else if (vm["command"].as<string>() == "restore") {
@@ -937,21 +1729,34 @@ int main(int argc, char **argv) {
                 }
             }
             
-			cerr << "Caching block indexes in memory..." << endl;
-			backupArchive->cacheBlockIndex();
-
 			if (dryRun) {
 				cerr << "Verifying archive integrity without restoring (dry-run)..." << endl;
 			} else {
 				cerr << "Restoring files..." << endl;
 			}
 
-			auto begin = backupArchive->begin(matchMode, matchString);
+			auto begin = backupArchive->begin(matchMode, matchString, filter);
 			auto end = backupArchive->end();
 
 			TimeMode timeMode = vm.count("at") ? TimeMode::atTime : TimeMode::latest;
 
-			bool success = restoreBackupFiles(*backupArchive, begin, end, destDirectory, includeDeleted, timeMode, at, dryRun, colonSupport);
+			int64_t batchBytes = (int64_t) (vm.count("batch-size") ? std::max(vm["batch-size"].as<int>(), 0) : 256) * 1024 * 1024;
+
+			int64_t restoreMemoryBytes = (int64_t) (vm.count("restore-memory") ? std::max(vm["restore-memory"].as<int>(), 0) : 1024) * 1024 * 1024;
+
+			int64_t blockCacheBytes = (int64_t) (vm.count("block-cache") ? std::max(vm["block-cache"].as<int>(), 0) : 64) * 1024 * 1024;
+			std::unique_ptr<DecodedBlockCache> blockCache;
+
+			if (blockCacheBytes > 0) {
+				blockCache.reset(new DecodedBlockCache(blockCacheBytes));
+			}
+
+			bool success = restoreBackupFiles(*backupArchive, begin, end, destDirectory, includeDeleted, timeMode, at, dryRun, colonSupport, batchBytes, blockCache.get(),
+				jobs, restoreMemoryBytes);
+
+			if (blockCache && vm.count("stats")) {
+				cerr << "Block cache: " << blockCache->getHits() << " hits, " << blockCache->getMisses() << " misses" << endl;
+			}
 
 			if (success) {
 				cerr << "Done!" << endl;
@@ -960,6 +1765,55 @@ int main(int argc, char **argv) {
 				cerr << "Errors were encountered during this restore" << endl;
 				return EXIT_FAILURE;
 			}
+		} else if (vm["command"].as<string>() == "verify-blocks") {
+			if (key.length() == 0) {
+				cerr << "No decryption key supplied, so only the archived checksums of encrypted or compressed blocks will be verified" << endl;
+			}
+
+			if (verifyArchiveBlocks(*backupArchive, jobs)) {
+				cerr << "Done!" << endl;
+				return EXIT_SUCCESS;
+			} else {
+				cerr << "Corrupt blocks or unreadable block directories were found in this archive" << endl;
+				return EXIT_FAILURE;
+			}
+		} else if (vm["command"].as<string>() == "du" || vm["command"].as<string>() == "find-block") {
+			if (vm["command"].as<string>() == "find-block" && !vm.count("block")) {
+				cerr << "You must supply at least one --block to look up" << endl;
+				return EXIT_FAILURE;
+			}
+
+			cerr << "Indexing block references..." << endl;
+
+			BlockReferenceIndex index(*backupArchive);
+
+			if (index.getUnreadableHistories() > 0) {
+				cerr << "Warning: The histories of " << index.getUnreadableHistories() << " files couldn't be read, so their blocks aren't indexed" << endl;
+			}
+
+			if (vm["command"].as<string>() == "du") {
+				printSpaceUsage(*backupArchive, index, matchMode, matchString, filter, vm.count("depth") ? std::max(vm["depth"].as<int>(), 0) : 2);
+			} else if (!printBlockReferences(*backupArchive, index, vm["block"].as<std::vector<int64_t>>())) {
+				return EXIT_FAILURE;
+			}
+
+			return EXIT_SUCCESS;
+		} else if (vm["command"].as<string>() == "tree") {
+			std::string path = vm.count("filename") ? vm["filename"].as<string>() : vm.count("prefix") ? vm["prefix"].as<string>() : "";
+
+			if (!printDirectoryTree(*backupArchive, path, vm.count("depth") ? std::max(vm["depth"].as<int>(), 0) : 2, includeDeleted)) {
+				return EXIT_FAILURE;
+			}
+
+			return EXIT_SUCCESS;
+		} else if (vm["command"].as<string>() == "list-snapshots") {
+			printSnapshots(*backupArchive, jobs);
+
+			return EXIT_SUCCESS;
+		} else if (vm["command"].as<string>() == "bench-paths") {
+			benchmarkPathDecryption(*backupArchive);
+
+			return EXIT_SUCCESS;
 		}
 	}
 
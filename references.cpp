@@ -0,0 +1,333 @@
+#define _POSIX_C_SOURCE 200112L
+#define _FILE_OFFSET_BITS 64
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <queue>
+#include <errno.h>
+
+#include "boost/filesystem/operations.hpp"
+
+#include "references.h"
+#include "cache.h"
+
+static const char *BLOCK_REFERENCE_CACHE_NAME = "blockrefs";
+static const uint32_t BLOCK_REFERENCE_CACHE_FORMAT = 2;
+
+/**
+ * Sorts a stream of references that might not fit in memory, by spilling sorted runs to temporary files and merging
+ * them at the end. Duplicate references are removed.
+ */
+class BlockReferenceSorter {
+private:
+	std::vector<BlockReference> buffer;
+	size_t capacity;
+
+	std::vector<std::pair<FILE *, boost::filesystem::path>> runs;
+
+	void spill();
+
+public:
+	explicit BlockReferenceSorter(size_t memoryLimit) : capacity(std::max(memoryLimit / sizeof(BlockReference), (size_t) 1024)) {
+	}
+
+	~BlockReferenceSorter();
+
+	void add(const BlockReference &reference) {
+		buffer.push_back(reference);
+
+		if (buffer.size() >= capacity) {
+			spill();
+		}
+	}
+
+	/**
+	 * Write the number of references followed by the sorted references themselves.
+	 */
+	bool writeTo(FILE *output);
+};
+
+BlockReferenceSorter::~BlockReferenceSorter() {
+	boost::system::error_code err;
+
+	for (auto &run : runs) {
+		fclose(run.first);
+		boost::filesystem::remove(run.second, err);
+	}
+}
+
+void BlockReferenceSorter::spill() {
+	boost::filesystem::path runPath = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("planc-blockrefs-%%%%-%%%%-%%%%.tmp");
+	FILE *run = fopen(runPath.string().c_str(), "w+b");
+
+	if (!run) {
+		throw std::runtime_error("Failed to create temporary file " + runPath.string() + ": " + strerror(errno));
+	}
+
+	runs.emplace_back(run, runPath);
+
+	std::sort(buffer.begin(), buffer.end());
+	buffer.erase(std::unique(buffer.begin(), buffer.end()), buffer.end());
+
+	if (!writeCacheArray(run, buffer)) {
+		throw std::runtime_error("Failed to write to temporary file " + runPath.string());
+	}
+
+	buffer.clear();
+}
+
+bool BlockReferenceSorter::writeTo(FILE *output) {
+	int64_t countPosition = ftello(output);
+	uint64_t written = 0;
+
+	// The count isn't known until duplicates have been merged away, so it's filled in at the end
+	if (!writeCacheValue(output, 0)) {
+		return false;
+	}
+
+	if (runs.empty()) {
+		std::sort(buffer.begin(), buffer.end());
+		buffer.erase(std::unique(buffer.begin(), buffer.end()), buffer.end());
+
+		if (!writeCacheArray(output, buffer)) {
+			return false;
+		}
+
+		written = buffer.size();
+	} else {
+		if (!buffer.empty()) {
+			spill();
+		}
+
+		std::vector<BlockReference>().swap(buffer);
+
+		// Merge the runs using a heap of the next reference from each run:
+		typedef std::pair<BlockReference, size_t> RunHead;
+		auto compare = [](const RunHead &a, const RunHead &b) {
+			return b.first < a.first;
+		};
+		std::priority_queue<RunHead, std::vector<RunHead>, decltype(compare)> heads(compare);
+
+		for (size_t i = 0; i < runs.size(); i++) {
+			BlockReference reference;
+
+			rewind(runs[i].first);
+
+			if (fread(&reference, sizeof(reference), 1, runs[i].first) == 1) {
+				heads.emplace(reference, i);
+			}
+		}
+
+		BlockReference previous;
+
+		while (!heads.empty()) {
+			RunHead head = heads.top();
+			heads.pop();
+
+			if (written == 0 || !(head.first == previous)) {
+				if (fwrite(&head.first, sizeof(head.first), 1, output) != 1) {
+					return false;
+				}
+
+				previous = head.first;
+				written++;
+			}
+
+			if (fread(&head.first, sizeof(head.first), 1, runs[head.second].first) == 1) {
+				heads.push(head);
+			}
+		}
+	}
+
+	return fseeko(output, countPosition, SEEK_SET) == 0
+		&& writeCacheValue(output, written)
+		&& fseeko(output, 0, SEEK_END) == 0;
+}
+
+/**
+ * Take ownership of the given index file (positioned at its count of unreadable histories), returning false (and
+ * closing it) if it's unusable.
+ */
+bool BlockReferenceIndex::open(FILE *source) {
+	if (!source) {
+		return false;
+	}
+
+	if (!readCacheValue(source, unreadableHistories) || !readCacheValue(source, count)) {
+		fclose(source);
+		return false;
+	}
+
+	file = source;
+	recordsStart = ftello(source);
+
+	return true;
+}
+
+bool BlockReferenceIndex::build(BackupArchive &archive, size_t memoryLimit, FILE *output) {
+	BlockReferenceSorter sorter(memoryLimit);
+
+	// How many upcoming files have their histories loaded together:
+	const size_t HISTORY_WINDOW = 1024;
+
+	auto begin = archive.begin(FilenameMatchMode::none, "");
+	auto end = archive.end();
+
+	FileHistoryBatch histories(archive);
+	std::vector<std::pair<uint32_t, FileManifestHeader>> window;
+
+	// Saved with the index, so runs which load it from the cache can still warn that it's incomplete:
+	uint64_t unreadable = 0;
+
+	for (uint32_t fileIndex = 0; begin != end; ) {
+		window.clear();
+		histories.clear();
+
+		for (; begin != end && window.size() < HISTORY_WINDOW; ++begin, fileIndex++) {
+			if (begin->hasHistory()) {
+				window.emplace_back(fileIndex, *begin);
+				histories.add(*begin);
+			}
+		}
+
+		histories.fetch();
+
+		for (size_t i = 0; i < window.size(); i++) {
+			const FileManifestHeader &file = window[i].second;
+
+			try {
+				FileHistory &fileHistory = histories.get(i);
+
+				for (auto iterator = fileHistory.begin(); iterator != fileHistory.end(); ++iterator) {
+					uint32_t revisionTime = (uint32_t) (iterator->version->timestamp / 1000);
+
+					for (int64_t blockNumber : iterator->blockList) {
+						sorter.add(BlockReference{blockNumber, window[i].first, revisionTime});
+					}
+				}
+			} catch (std::exception &e) {
+				unreadable++;
+				std::cerr << "Error: Failed to read the history of '" << file.path << "', its blocks won't be indexed: " << e.what() << std::endl;
+			}
+		}
+	}
+
+	return writeCacheValue(output, unreadable) && sorter.writeTo(output);
+}
+
+BlockReferenceIndex::BlockReferenceIndex(BackupArchive &archive, size_t memoryLimit) : file(nullptr), recordsStart(0), count(0), unreadableHistories(0) {
+	const IndexCache &cache = archive.getIndexCache();
+	std::vector<boost::filesystem::path> sources = archive.getFileIndexSources();
+
+	if (open(cache.openForReading(BLOCK_REFERENCE_CACHE_NAME, BLOCK_REFERENCE_CACHE_FORMAT, sources))) {
+		return;
+	}
+
+	if (cache.isEnabled()) {
+		cache.write(BLOCK_REFERENCE_CACHE_NAME, BLOCK_REFERENCE_CACHE_FORMAT, sources, [&archive, memoryLimit](FILE *output) {
+			return build(archive, memoryLimit, output);
+		});
+
+		if (open(cache.openForReading(BLOCK_REFERENCE_CACHE_NAME, BLOCK_REFERENCE_CACHE_FORMAT, sources))) {
+			return;
+		}
+	}
+
+	// Without a cache to keep it in, the index is built in a temporary file instead:
+	temporaryPath = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("planc-blockrefs-%%%%-%%%%-%%%%.tmp");
+
+	FILE *output = fopen(temporaryPath.string().c_str(), "w+b");
+
+	if (!output) {
+		throw std::runtime_error("Failed to create temporary file " + temporaryPath.string() + ": " + strerror(errno));
+	}
+
+	if (!build(archive, memoryLimit, output) || fflush(output) != 0 || fseeko(output, 0, SEEK_SET) != 0) {
+		fclose(output);
+		throw std::runtime_error("Failed to write block reference index to " + temporaryPath.string());
+	}
+
+	if (!open(output)) {
+		throw std::runtime_error("Failed to read back block reference index from " + temporaryPath.string());
+	}
+}
+
+BlockReferenceIndex::~BlockReferenceIndex() {
+	if (file) {
+		fclose(file);
+	}
+
+	if (!temporaryPath.empty()) {
+		boost::system::error_code err;
+
+		boost::filesystem::remove(temporaryPath, err);
+	}
+}
+
+std::vector<BlockReference> BlockReferenceIndex::find(int64_t blockNumber) const {
+	std::vector<BlockReference> result;
+	BlockReference reference;
+
+	// Find the first reference to the block:
+	uint64_t low = 0, high = count;
+
+	while (low < high) {
+		uint64_t middle = low + (high - low) / 2;
+
+		if (readFileAt(fileno(file), &reference, sizeof(reference), recordsStart + middle * sizeof(reference)) != sizeof(reference)) {
+			throw std::runtime_error("Block reference index is truncated");
+		}
+
+		if (reference.blockNumber < blockNumber) {
+			low = middle + 1;
+		} else {
+			high = middle;
+		}
+	}
+
+	for (uint64_t i = low; i < count; i++) {
+		if (readFileAt(fileno(file), &reference, sizeof(reference), recordsStart + i * sizeof(reference)) != sizeof(reference)) {
+			throw std::runtime_error("Block reference index is truncated");
+		}
+
+		if (reference.blockNumber != blockNumber) {
+			break;
+		}
+
+		result.push_back(reference);
+	}
+
+	return result;
+}
+
+void BlockReferenceIndex::forEachBlock(const std::function<void(int64_t blockNumber, const std::vector<BlockReference> &references)> &visitor) const {
+	const size_t CHUNK_RECORDS = 64 * 1024;
+
+	std::vector<BlockReference> chunk(CHUNK_RECORDS);
+	std::vector<BlockReference> references;
+
+	for (uint64_t position = 0; position < count; ) {
+		size_t chunkRecords = (size_t) std::min((uint64_t) CHUNK_RECORDS, count - position);
+		size_t bytes = chunkRecords * sizeof(BlockReference);
+
+		if (readFileAt(fileno(file), chunk.data(), bytes, recordsStart + position * sizeof(BlockReference)) != bytes) {
+			throw std::runtime_error("Block reference index is truncated");
+		}
+
+		for (size_t i = 0; i < chunkRecords; i++) {
+			if (!references.empty() && references[0].blockNumber != chunk[i].blockNumber) {
+				visitor(references[0].blockNumber, references);
+				references.clear();
+			}
+
+			references.push_back(chunk[i]);
+		}
+
+		position += chunkRecords;
+	}
+
+	if (!references.empty()) {
+		visitor(references[0].blockNumber, references);
+	}
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <vector>
+
+#include "boost/filesystem/path.hpp"
+
+#include "backup.h"
+
+/**
+ * A reference from a revision of a file to one of the blocks it is made of.
+ */
+class BlockReference {
+public:
+	int64_t blockNumber;
+
+	// Position of the file in the file manifest:
+	uint32_t fileIndex;
+
+	// Time of the revision in seconds since the epoch, which identifies the revision within its file:
+	uint32_t revisionTime;
+
+	bool operator<(const BlockReference &that) const {
+		if (blockNumber != that.blockNumber) {
+			return blockNumber < that.blockNumber;
+		}
+		if (fileIndex != that.fileIndex) {
+			return fileIndex < that.fileIndex;
+		}
+		return revisionTime < that.revisionTime;
+	}
+
+	bool operator==(const BlockReference &that) const {
+		return blockNumber == that.blockNumber && fileIndex == that.fileIndex && revisionTime == that.revisionTime;
+	}
+};
+
+/**
+ * Records which file revisions refer to each block of the archive, as a file of references sorted by block number.
+ *
+ * It's built in one pass over the history of every file. References are collected in memory up to a limit, then
+ * sorted and spilled to temporary files which are merged at the end, so memory use stays bounded no matter how many
+ * references the archive holds.
+ *
+ * If the archive has an index cache the result is kept there, otherwise it's built in a temporary file that is
+ * removed when the index is destroyed.
+ */
+class BlockReferenceIndex {
+private:
+	FILE *file;
+	int64_t recordsStart;
+	uint64_t count;
+
+	// How many files' histories couldn't be read when the index was built, so their blocks are missing from it:
+	uint64_t unreadableHistories;
+
+	boost::filesystem::path temporaryPath;
+
+	bool open(FILE *source);
+	static bool build(BackupArchive &archive, size_t memoryLimit, FILE *output);
+
+public:
+	static const size_t DEFAULT_MEMORY_LIMIT = 256 * 1024 * 1024;
+
+	explicit BlockReferenceIndex(BackupArchive &archive, size_t memoryLimit = DEFAULT_MEMORY_LIMIT);
+	~BlockReferenceIndex();
+
+	BlockReferenceIndex(const BlockReferenceIndex &) = delete;
+	BlockReferenceIndex& operator= (const BlockReferenceIndex &) = delete;
+
+	uint64_t size() const {
+		return count;
+	}
+
+	uint64_t getUnreadableHistories() const {
+		return unreadableHistories;
+	}
+
+	/**
+	 * Find all the references to the given block.
+	 */
+	std::vector<BlockReference> find(int64_t blockNumber) const;
+
+	/**
+	 * Call the visitor for every referenced block in block number order, along with all of its references.
+	 */
+	void forEachBlock(const std::function<void(int64_t blockNumber, const std::vector<BlockReference> &references)> &visitor) const;
+};
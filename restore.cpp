@@ -0,0 +1,401 @@
+#include <algorithm>
+#include <cstring>
+
+#include "boost/asio/post.hpp"
+
+#include "restore.h"
+#include "crypto.h"
+
+BlockDecodeStatus BlockDecoder::decode(const DataBlock &block, boost::string_view archivedData, boost::string_view &plaintext) {
+	uint8_t cipher = block.getCipher();
+
+	if (block.isEncrypted() || block.isCompressed()) {
+		// Check that the archived block isn't corrupt before we try something interesting like decryption or decompression
+
+		CryptoPP::byte archivedHash[CryptoPP::Weak::MD5::DIGESTSIZE];
+		hasher.Update((const CryptoPP::byte*) archivedData.data(), archivedData.length());
+		hasher.Final(archivedHash);
+
+		if (memcmp(archivedHash, block.backupMD5, sizeof(archivedHash)) != 0) {
+			return BlockDecodeStatus::badArchivedMD5;
+		}
+	}
+
+	retryDecrypt:
+
+	if (block.isEncrypted() && isValidCipherCode(cipher)) {
+		try {
+			decryptedData = code42Ciphers[cipher]->decrypt((const uint8_t *) archivedData.data(), archivedData.length(), key);
+			archivedData = decryptedData;
+		} catch (BadPaddingException & e) {
+			if (cipher == CIPHER_CODE_BLOWFISH_448) {
+				cipher = CIPHER_CODE_BLOWFISH_128;
+				goto retryDecrypt;
+			}
+			throw;
+		}
+	}
+
+	if (block.isCompressed()) {
+		try {
+			inflater.inflate(archivedData, decompressedData, block.sourceLen > 0 ? block.sourceLen : 0);
+			archivedData = decompressedData;
+		} catch (std::exception & e) {
+			if (block.type != DATA_BLOCK_TYPE_UNKNOWN) {
+				throw;
+			}
+
+			/* If the "compressed" MD5 is the same as the source MD5, it was never compressed in the first
+			 * place and we can just pass it through.
+			 */
+			CryptoPP::byte compressedHash[CryptoPP::Weak::MD5::DIGESTSIZE];
+			hasher.Update((const CryptoPP::byte*) archivedData.data(), archivedData.length());
+			hasher.Final(compressedHash);
+
+			if (memcmp(compressedHash, block.sourceMD5, sizeof(compressedHash)) != 0) {
+				throw;
+			}
+		}
+	}
+
+	plaintext = archivedData;
+
+	// Check that the hash of the restored block is the same as what it was raw on disk when first backed up
+	CryptoPP::byte restoredHash[CryptoPP::Weak::MD5::DIGESTSIZE];
+	hasher.Update((const CryptoPP::byte*) plaintext.data(), plaintext.length());
+	hasher.Final(restoredHash);
+
+	if (memcmp(restoredHash, block.sourceMD5, sizeof(restoredHash)) != 0) {
+		return BlockDecodeStatus::badSourceMD5;
+	}
+
+	return BlockDecodeStatus::ok;
+}
+
+size_t DecodedBlockCache::sizeOf(const DecodedBlock &block) {
+	// Count the bookkeeping too, so caching many tiny blocks can't exceed the limit by much
+	return sizeof(DecodedBlock) + block.data.capacity() + block.error.capacity() + 64;
+}
+
+std::shared_ptr<const DecodedBlock> DecodedBlockCache::find(int64_t blockNumber) {
+	std::lock_guard<std::mutex> lock(mutex);
+
+	auto found = blocksIndex.find(blockNumber);
+
+	if (found == blocksIndex.end()) {
+		misses++;
+		return nullptr;
+	}
+
+	hits++;
+
+	blocks.splice(blocks.begin(), blocks, found->second);
+
+	return found->second->second;
+}
+
+void DecodedBlockCache::insert(int64_t blockNumber, const std::shared_ptr<const DecodedBlock> &block) {
+	if (block->status != BlockDecodeStatus::ok || !block->error.empty()) {
+		return;
+	}
+
+	size_t blockSize = sizeOf(*block);
+
+	if (blockSize > maxBytes) {
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(mutex);
+
+	if (blocksIndex.find(blockNumber) != blocksIndex.end()) {
+		return;
+	}
+
+	while (bytes + blockSize > maxBytes) {
+		bytes -= sizeOf(*blocks.back().second);
+		blocksIndex.erase(blocks.back().first);
+		blocks.pop_back();
+	}
+
+	blocks.emplace_front(blockNumber, block);
+	blocksIndex[blockNumber] = blocks.begin();
+	bytes += blockSize;
+}
+
+uint64_t DecodedBlockCache::getHits() {
+	std::lock_guard<std::mutex> lock(mutex);
+
+	return hits;
+}
+
+uint64_t DecodedBlockCache::getMisses() {
+	std::lock_guard<std::mutex> lock(mutex);
+
+	return misses;
+}
+
+void RestoreBatch::add(const BlockList &blockList, int64_t sourceLength) {
+	blockNumbers.insert(blockNumbers.end(), blockList.begin(), blockList.end());
+	sourceBytes += sourceLength;
+}
+
+void RestoreBatch::fetch() {
+	// Blocks are often shared between files, but only need to be read once:
+	std::sort(blockNumbers.begin(), blockNumbers.end());
+	blockNumbers.erase(std::unique(blockNumbers.begin(), blockNumbers.end()), blockNumbers.end());
+
+	std::vector<std::pair<BlockLocation, int64_t>> locations;
+
+	locations.reserve(blockNumbers.size());
+
+	for (int64_t blockNumber : blockNumbers) {
+		if (cache) {
+			std::shared_ptr<const DecodedBlock> cached = cache->find(blockNumber);
+
+			if (cached) {
+				blocks[blockNumber] = cached;
+				continue;
+			}
+		}
+
+		try {
+			locations.emplace_back(archive.blockDirectories.locateBlock(blockNumber), blockNumber);
+		} catch (std::exception &e) {
+			std::shared_ptr<DecodedBlock> failed = std::make_shared<DecodedBlock>();
+
+			failed->error = e.what();
+			blocks[blockNumber] = failed;
+		}
+	}
+
+	// Put the reads into the order the blocks are stored on disk:
+	std::sort(locations.begin(), locations.end(),
+		[](const std::pair<BlockLocation, int64_t> &a, const std::pair<BlockLocation, int64_t> &b) {
+			if (a.first.manifest != b.first.manifest) {
+				return a.first.manifest->firstBlockNum < b.first.manifest->firstBlockNum;
+			}
+			return a.first.entry.offset < b.first.entry.offset;
+		}
+	);
+
+	std::vector<int64_t> readOrder;
+
+	readOrder.reserve(locations.size());
+
+	for (auto &location : locations) {
+		readOrder.push_back(location.second);
+	}
+
+	BlockReader reader(archive.blockDirectories, readOrder);
+	BlockDecoder decoder(archive.key);
+
+	reader.adviseWillNeed();
+
+	for (size_t i = 0; i < readOrder.size(); i++) {
+		std::shared_ptr<DecodedBlock> decoded = std::make_shared<DecodedBlock>();
+
+		try {
+			boost::string_view archivedData, plaintext;
+			DataBlock block = reader.read(i, archivedData);
+
+			decoded->sourceLen = block.sourceLen;
+			decoded->status = decoder.decode(block, archivedData, plaintext);
+
+			if (decoded->status != BlockDecodeStatus::badArchivedMD5) {
+				decoded->data.assign(plaintext.data(), plaintext.length());
+			}
+		} catch (std::exception &e) {
+			decoded->error = e.what();
+		}
+
+		blocks[readOrder[i]] = decoded;
+
+		if (cache) {
+			cache->insert(readOrder[i], decoded);
+		}
+	}
+}
+
+const DecodedBlock& RestoreBatch::getBlock(int64_t blockNumber) const {
+	auto found = blocks.find(blockNumber);
+
+	if (found == blocks.end()) {
+		throw std::runtime_error("Block " + std::to_string(blockNumber) + " was not fetched as part of this restore batch");
+	}
+
+	return *found->second;
+}
+
+void RestoreBatch::clear() {
+	blockNumbers.clear();
+	blocks.clear();
+	sourceBytes = 0;
+}
+
+ReadAheadBudget::ReadAheadBudget(size_t blocks) : available(std::max(blocks, (size_t) 1)), waiting(0) {
+}
+
+void ReadAheadBudget::acquire() {
+	std::unique_lock<std::mutex> lock(mutex);
+
+	waiting++;
+	released.wait(lock, [this]() {
+		return available > 0;
+	});
+	waiting--;
+	available--;
+}
+
+bool ReadAheadBudget::tryAcquire() {
+	std::lock_guard<std::mutex> lock(mutex);
+
+	if (available == 0 || waiting > 0) {
+		return false;
+	}
+
+	available--;
+
+	return true;
+}
+
+void ReadAheadBudget::release(size_t blocks) {
+	if (blocks == 0) {
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+
+		available += blocks;
+	}
+
+	released.notify_all();
+}
+
+PipelinedBlockDecoder::PipelinedBlockDecoder(const BackupArchive &archive, const BlockList &blockList, boost::asio::thread_pool &pool,
+											 ReadAheadBudget &budget, DecodedBlockCache *cache) :
+	archive(archive),
+	blockList(blockList),
+	pool(pool),
+	budget(budget),
+	cache(cache),
+	reader(archive.blockDirectories, blockList),
+	nextRead(0) {
+	readAhead();
+}
+
+PipelinedBlockDecoder::~PipelinedBlockDecoder() {
+	// The workers use our decoders, so they have to finish with the blocks we abandoned first
+	for (auto &block : inFlight) {
+		block.wait();
+	}
+
+	budget.release(inFlight.size());
+}
+
+std::shared_ptr<const DecodedBlock> PipelinedBlockDecoder::decode(int64_t blockNumber, const DataBlock &block, const std::string &archivedData) {
+	std::unique_ptr<BlockDecoder> decoder;
+
+	{
+		std::lock_guard<std::mutex> lock(decodersMutex);
+
+		if (decoders.empty()) {
+			decoder.reset(new BlockDecoder(archive.key));
+		} else {
+			decoder = std::move(decoders.back());
+			decoders.pop_back();
+		}
+	}
+
+	std::shared_ptr<DecodedBlock> decoded = std::make_shared<DecodedBlock>();
+
+	decoded->sourceLen = block.sourceLen;
+
+	try {
+		boost::string_view plaintext;
+
+		decoded->status = decoder->decode(block, archivedData, plaintext);
+
+		if (decoded->status != BlockDecodeStatus::badArchivedMD5) {
+			decoded->data.assign(plaintext.data(), plaintext.length());
+		}
+	} catch (std::exception &e) {
+		decoded->error = e.what();
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(decodersMutex);
+
+		decoders.push_back(std::move(decoder));
+	}
+
+	if (cache) {
+		cache->insert(blockNumber, decoded);
+	}
+
+	return decoded;
+}
+
+void PipelinedBlockDecoder::readAhead() {
+	for (; nextRead < blockList.size(); nextRead++) {
+		// Without any blocks in flight we can't make progress, so wait for another decoder to give some back
+		if (inFlight.empty()) {
+			budget.acquire();
+		} else if (!budget.tryAcquire()) {
+			break;
+		}
+
+		int64_t blockNumber = blockList[nextRead];
+		std::promise<std::shared_ptr<const DecodedBlock>> ready;
+
+		if (cache) {
+			std::shared_ptr<const DecodedBlock> cached = cache->find(blockNumber);
+
+			if (cached) {
+				ready.set_value(cached);
+				inFlight.push_back(ready.get_future());
+				continue;
+			}
+		}
+
+		DataBlock block;
+		std::shared_ptr<std::string> archivedData;
+
+		try {
+			boost::string_view payload;
+
+			block = reader.read(nextRead, payload);
+
+			// (The reader reuses its buffer for the next block)
+			archivedData = std::make_shared<std::string>(payload.data(), payload.length());
+		} catch (std::exception &e) {
+			std::shared_ptr<DecodedBlock> failed = std::make_shared<DecodedBlock>();
+
+			failed->error = e.what();
+			ready.set_value(failed);
+			inFlight.push_back(ready.get_future());
+			continue;
+		}
+
+		auto task = std::make_shared<std::packaged_task<std::shared_ptr<const DecodedBlock>()>>([this, blockNumber, block, archivedData]() {
+			return decode(blockNumber, block, *archivedData);
+		});
+
+		inFlight.push_back(task->get_future());
+		boost::asio::post(pool, [task]() {
+			(*task)();
+		});
+	}
+}
+
+std::shared_ptr<const DecodedBlock> PipelinedBlockDecoder::next() {
+	std::shared_ptr<const DecodedBlock> result = inFlight.front().get();
+
+	inFlight.pop_front();
+	budget.release();
+
+	// Keep the workers busy while the caller writes this block out
+	readAhead();
+
+	return result;
+}
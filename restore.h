@@ -0,0 +1,231 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "boost/asio/thread_pool.hpp"
+
+#define CRYPTOPP_ENABLE_NAMESPACE_WEAK 1
+#include "cryptopp/md5.h"
+
+#include "backup.h"
+#include "blocks.h"
+
+enum class BlockDecodeStatus {
+	ok,
+	// The archived data is damaged, so it wasn't decrypted or decompressed and no plaintext is available:
+	badArchivedMD5,
+	// The block decoded, but the plaintext doesn't match the original file's data:
+	badSourceMD5
+};
+
+/**
+ * Verifies, decrypts and decompresses archived blocks. Keeps its working buffers between blocks, so use one decoder per
+ * thread.
+ */
+class BlockDecoder {
+private:
+	const std::string &key;
+
+	CryptoPP::Weak::MD5 hasher;
+	Inflater inflater;
+	std::string decryptedData, decompressedData;
+
+public:
+	explicit BlockDecoder(const std::string &key) : key(key) {
+	}
+
+	/**
+	 * Decode the archived data of the given block. Unless the archived data turns out to be corrupt, plaintext is set
+	 * to a view of the decoded data which remains valid until the next call.
+	 */
+	BlockDecodeStatus decode(const DataBlock &block, boost::string_view archivedData, boost::string_view &plaintext);
+};
+
+class DecodedBlock {
+public:
+	BlockDecodeStatus status;
+	int sourceLen;
+	std::string data;
+
+	// If the block couldn't be read or decoded at all, the reason why:
+	std::string error;
+
+	DecodedBlock() : status(BlockDecodeStatus::ok), sourceLen(0) {
+	}
+};
+
+/**
+ * Holds the plaintext of recently decoded blocks, up to a limit on their total size, discarding the least recently used
+ * block first. CrashPlan de-duplicates blocks both between revisions of a file and between files with the same content,
+ * so a restore often needs the same block several times.
+ *
+ * Only blocks which decoded and verified successfully are kept. Safe to share between threads.
+ */
+class DecodedBlockCache {
+private:
+	typedef std::list<std::pair<int64_t, std::shared_ptr<const DecodedBlock>>> CachedBlockList;
+
+	std::mutex mutex;
+
+	size_t maxBytes;
+	size_t bytes;
+
+	// Most recently used at the front:
+	CachedBlockList blocks;
+	std::unordered_map<int64_t, CachedBlockList::iterator> blocksIndex;
+
+	uint64_t hits, misses;
+
+	static size_t sizeOf(const DecodedBlock &block);
+
+public:
+	explicit DecodedBlockCache(size_t maxBytes) : maxBytes(maxBytes), bytes(0), hits(0), misses(0) {
+	}
+
+	/**
+	 * Look up a block, returning nullptr if it isn't cached.
+	 */
+	std::shared_ptr<const DecodedBlock> find(int64_t blockNumber);
+
+	void insert(int64_t blockNumber, const std::shared_ptr<const DecodedBlock> &block);
+
+	uint64_t getHits();
+	uint64_t getMisses();
+};
+
+/**
+ * Fetches and decodes all the blocks needed to restore a group of file revisions in one pass, reading them in the
+ * order they are stored in the archive (by block directory, then offset) rather than file by file. On spinning disks
+ * and network storage this turns a seek-bound restore into a mostly sequential scan.
+ *
+ * The decoded blocks are held in memory until the batch is cleared, so callers limit the batch size.
+ */
+class RestoreBatch {
+private:
+	const BackupArchive &archive;
+	DecodedBlockCache *cache;
+
+	std::vector<int64_t> blockNumbers;
+	std::unordered_map<int64_t, std::shared_ptr<const DecodedBlock>> blocks;
+
+	int64_t sourceBytes;
+
+public:
+	/**
+	 * Blocks found in the cache (if supplied) aren't read again, and newly decoded blocks are added to it.
+	 */
+	explicit RestoreBatch(const BackupArchive &archive, DecodedBlockCache *cache = nullptr) : archive(archive), cache(cache), sourceBytes(0) {
+	}
+
+	/**
+	 * Add the blocks of a file revision to the batch.
+	 */
+	void add(const BlockList &blockList, int64_t sourceLength);
+
+	/**
+	 * The total original size of the revisions added to the batch so far.
+	 */
+	int64_t getSourceBytes() const {
+		return sourceBytes;
+	}
+
+	/**
+	 * Read and decode every block that was added to the batch. Errors are recorded against the blocks they affect
+	 * rather than thrown.
+	 */
+	void fetch();
+
+	const DecodedBlock& getBlock(int64_t blockNumber) const;
+
+	void clear();
+};
+
+/**
+ * The number of blocks that the PipelinedBlockDecoders sharing a decode pool can have read ahead between them, so the
+ * memory they use is bounded however many files are being restored at once.
+ */
+class ReadAheadBudget {
+private:
+	std::mutex mutex;
+	std::condition_variable released;
+	size_t available;
+	size_t waiting;
+
+public:
+	explicit ReadAheadBudget(size_t blocks);
+
+	ReadAheadBudget(const ReadAheadBudget &) = delete;
+	ReadAheadBudget& operator= (const ReadAheadBudget &) = delete;
+
+	/**
+	 * Wait until a block can be read ahead, and take it from the budget.
+	 */
+	void acquire();
+
+	/**
+	 * Take a block from the budget if there's one available and nobody is waiting for it in acquire(), otherwise
+	 * return false.
+	 */
+	bool tryAcquire();
+
+	void release(size_t blocks = 1);
+};
+
+/**
+ * Decodes the blocks of one file revision on a thread pool, so a single large file can be decoded by several cores.
+ * The caller's thread reads the blocks in order and collects them again in the same order with next(), while the
+ * workers verify, decrypt and decompress the blocks in between. Each block read ahead of the one being collected is
+ * taken from the budget, which is shared by every decoder using the pool, so that bounds the memory they all use.
+ *
+ * Blocks found in the cache (if supplied) aren't read again, and newly decoded blocks are added to it.
+ */
+class PipelinedBlockDecoder {
+private:
+	const BackupArchive &archive;
+	const BlockList &blockList;
+	boost::asio::thread_pool &pool;
+	ReadAheadBudget &budget;
+	DecodedBlockCache *cache;
+
+	BlockReader reader;
+	size_t nextRead;
+
+	// The blocks that have been read (or found in the cache) but not yet collected, in file order:
+	std::deque<std::future<std::shared_ptr<const DecodedBlock>>> inFlight;
+
+	// Decoders which aren't being used by a worker at the moment:
+	std::mutex decodersMutex;
+	std::vector<std::unique_ptr<BlockDecoder>> decoders;
+
+	std::shared_ptr<const DecodedBlock> decode(int64_t blockNumber, const DataBlock &block, const std::string &archivedData);
+
+	void readAhead();
+
+public:
+	PipelinedBlockDecoder(const BackupArchive &archive, const BlockList &blockList, boost::asio::thread_pool &pool, ReadAheadBudget &budget,
+						  DecodedBlockCache *cache = nullptr);
+
+	PipelinedBlockDecoder(const PipelinedBlockDecoder &) = delete;
+	PipelinedBlockDecoder& operator= (const PipelinedBlockDecoder &) = delete;
+
+	~PipelinedBlockDecoder();
+
+	bool hasNext() const {
+		return !inFlight.empty();
+	}
+
+	/**
+	 * Wait for the next block of the file to be decoded and return it. If it couldn't be read or decoded, its error is
+	 * set.
+	 */
+	std::shared_ptr<const DecodedBlock> next();
+};
@@ -0,0 +1,112 @@
+#include <algorithm>
+#include <map>
+#include <mutex>
+
+#include "boost/asio/post.hpp"
+#include "boost/asio/thread_pool.hpp"
+
+#include "timeline.h"
+#include "cache.h"
+
+static const std::string SNAPSHOT_TIMELINE_CACHE_NAME = "snapshots";
+static const uint32_t SNAPSHOT_TIMELINE_CACHE_FORMAT = 1;
+
+SnapshotTimeline::SnapshotTimeline(BackupArchive &archive, int jobs) : unreadableHistories(0) {
+	const IndexCache &cache = archive.getIndexCache();
+	std::vector<boost::filesystem::path> sources = archive.getFileIndexSources();
+
+	FILE *cacheFile = cache.openForReading(SNAPSHOT_TIMELINE_CACHE_NAME, SNAPSHOT_TIMELINE_CACHE_FORMAT, sources);
+	uint64_t count;
+
+	if (cacheFile && readCacheValue(cacheFile, unreadableHistories) && readCacheValue(cacheFile, count)
+			&& readCacheArray(cacheFile, snapshots, count)) {
+		fclose(cacheFile);
+		return;
+	}
+
+	if (cacheFile) {
+		fclose(cacheFile);
+	}
+
+	build(archive, jobs);
+
+	cache.write(SNAPSHOT_TIMELINE_CACHE_NAME, SNAPSHOT_TIMELINE_CACHE_FORMAT, sources, [this](FILE *file) {
+		return writeCacheValue(file, unreadableHistories) && writeCacheValue(file, snapshots.size()) && writeCacheArray(file, snapshots);
+	});
+}
+
+void SnapshotTimeline::build(BackupArchive &archive, int jobs) {
+	// How many histories each worker task reads and decodes:
+	const size_t HISTORIES_PER_TASK = 4096;
+
+	std::vector<FileHistoryLocation> locations = archive.getFileHistoryLocations();
+
+	// Divide the file history into consecutive runs of records for the workers, so it's read front to back:
+	std::sort(locations.begin(), locations.end(), [](const FileHistoryLocation &a, const FileHistoryLocation &b) {
+		return a.position < b.position;
+	});
+
+	std::map<int64_t, Snapshot> timeline;
+	uint64_t unreadable = 0;
+	std::mutex mutex;
+
+	boost::asio::thread_pool pool(std::max(jobs, 1));
+
+	for (size_t first = 0; first < locations.size(); first += HISTORIES_PER_TASK) {
+		boost::asio::post(pool, [&archive, &locations, first, HISTORIES_PER_TASK, &timeline, &unreadable, &mutex]() {
+			size_t last = std::min(first + HISTORIES_PER_TASK, locations.size());
+
+			FileHistoryBatch histories(archive);
+			std::map<int64_t, Snapshot> found;
+			uint64_t failed = 0;
+
+			for (size_t i = first; i < last; i++) {
+				histories.add(locations[i]);
+			}
+
+			histories.fetch();
+
+			for (size_t i = 0; i < histories.size(); i++) {
+				try {
+					for (auto &version : histories.get(i).versions) {
+						int64_t time = version.timestamp / 1000;
+						Snapshot &snapshot = found.emplace(time, Snapshot{time, 0, 0, 0}).first->second;
+
+						snapshot.files++;
+
+						if (version.isDeleted()) {
+							snapshot.deletedFiles++;
+						} else if (version.sourceLength > 0) {
+							snapshot.changedBytes += version.sourceLength;
+						}
+					}
+				} catch (std::exception &e) {
+					failed++;
+				}
+			}
+
+			std::lock_guard<std::mutex> lock(mutex);
+
+			for (auto &entry : found) {
+				Snapshot &snapshot = timeline.emplace(entry.first, Snapshot{entry.first, 0, 0, 0}).first->second;
+
+				snapshot.files += entry.second.files;
+				snapshot.deletedFiles += entry.second.deletedFiles;
+				snapshot.changedBytes += entry.second.changedBytes;
+			}
+
+			unreadable += failed;
+		});
+	}
+
+	pool.join();
+
+	snapshots.clear();
+	snapshots.reserve(timeline.size());
+
+	for (auto &entry : timeline) {
+		snapshots.push_back(entry.second);
+	}
+
+	unreadableHistories = unreadable;
+}
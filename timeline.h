@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "backup.h"
+
+/**
+ * A time at which files were backed up, with the revisions of files recorded at that time.
+ */
+class Snapshot {
+public:
+	// Seconds since the epoch (revisions are grouped by the second they were made in, the resolution of --at):
+	int64_t time;
+
+	// Revisions recorded at this time, and how many of those recorded a file being deleted:
+	uint64_t files;
+	uint64_t deletedFiles;
+
+	// Total size of the files as of the revisions recorded at this time (not counting deletions):
+	uint64_t changedBytes;
+};
+
+/**
+ * The distinct times at which the files of the archive were backed up, found from the history of every file.
+ *
+ * It's built in one pass over the file history (cphdf), reading the histories in the order they're stored and decoding
+ * them on a pool of worker threads. Only the manifest's history pointers are needed, not its paths, so building it
+ * doesn't need the archive's key. The result is kept in the index cache (if the archive has one).
+ */
+class SnapshotTimeline {
+private:
+	std::vector<Snapshot> snapshots;
+	uint64_t unreadableHistories;
+
+	void build(BackupArchive &archive, int jobs);
+
+public:
+	SnapshotTimeline(BackupArchive &archive, int jobs);
+
+	/**
+	 * The snapshots in time order.
+	 */
+	const std::vector<Snapshot>& getSnapshots() const {
+		return snapshots;
+	}
+
+	/**
+	 * The number of files whose history couldn't be read or decoded when the timeline was built (and so aren't counted).
+	 */
+	uint64_t getUnreadableHistories() const {
+		return unreadableHistories;
+	}
+};
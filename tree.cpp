@@ -0,0 +1,341 @@
+#include <algorithm>
+#include <cstring>
+#include <functional>
+
+#include "tree.h"
+
+uint32_t StringPool::intern(boost::string_view s) {
+	std::string key(s.data(), s.length());
+	auto found = ids.find(key);
+
+	if (found != ids.end()) {
+		return found->second;
+	}
+
+	uint32_t id = (uint32_t) size();
+
+	data.append(key);
+	offsets.push_back(data.length());
+	ids.emplace(std::move(key), id);
+
+	return id;
+}
+
+void StringPool::freeze() {
+	std::unordered_map<std::string, uint32_t>().swap(ids);
+	data.shrink_to_fit();
+	offsets.shrink_to_fit();
+}
+
+const uint32_t DirectoryTree::ROOT;
+const uint32_t DirectoryTree::NO_FILE;
+
+static const uint32_t NO_NODE = UINT32_MAX;
+
+/**
+ * A file ID from the manifest, usable as a hash key.
+ */
+class TreeFileId {
+public:
+	uint64_t high, low;
+
+	explicit TreeFileId(const CryptoPP::byte *id) {
+		memcpy(&high, id, sizeof(high));
+		memcpy(&low, id + sizeof(high), sizeof(low));
+	}
+
+	bool operator==(const TreeFileId &that) const {
+		return high == that.high && low == that.low;
+	}
+};
+
+class TreeFileIdHash {
+public:
+	size_t operator()(const TreeFileId &id) const {
+		// IDs are MD5 digests, so their bits are already well mixed
+		return (size_t) (id.high ^ id.low);
+	}
+};
+
+/**
+ * Split a path into its parent's path and its own name, e.g. "/Users/dave" into "/Users" and "dave". The root
+ * directory is named "/" (so "/Users" splits into "/" and "Users"), and a path with no separator has an empty parent.
+ */
+static void splitPath(boost::string_view path, boost::string_view &parent, boost::string_view &name) {
+	size_t separator = path.rfind('/');
+
+	if (separator == boost::string_view::npos || path == "/") {
+		parent = boost::string_view();
+		name = path;
+	} else {
+		parent = path.substr(0, separator == 0 ? 1 : separator);
+		name = path.substr(separator + 1);
+	}
+}
+
+uint32_t DirectoryTree::addNode(uint32_t name, uint8_t fileType) {
+	DirectoryTreeNode node;
+
+	node.parent = ROOT;
+	node.name = name;
+	node.firstChild = 0;
+	node.childCount = 0;
+	node.fileIndex = NO_FILE;
+	node.fileType = fileType;
+	node.deleted = false;
+	node.sourceLength = 0;
+
+	nodes.push_back(node);
+
+	return (uint32_t) (nodes.size() - 1);
+}
+
+DirectoryTree::DirectoryTree(BackupArchive &archive) {
+	class PendingFile {
+	public:
+		uint32_t node;
+		TreeFileId parentFileId;
+		uint32_t parentPath;
+	};
+
+	std::unordered_map<TreeFileId, uint32_t, TreeFileIdHash> fileIds;
+	std::vector<PendingFile> pending;
+
+	// Directory paths are shared by many files, so they're interned too, and each maps to its node once known:
+	StringPool directoryPaths;
+	std::vector<uint32_t> directoryNodes;
+
+	auto directoryNode = [&directoryNodes](uint32_t path) -> uint32_t& {
+		if (path >= directoryNodes.size()) {
+			directoryNodes.resize(path + 1, NO_NODE);
+		}
+		return directoryNodes[path];
+	};
+
+	addNode(names.intern(""), FILE_TYPE_DIRECTORY);
+	directoryNode(directoryPaths.intern("")) = ROOT;
+
+	auto begin = archive.begin(FilenameMatchMode::none, "");
+	auto end = archive.end();
+
+	for (uint32_t fileIndex = 0; begin != end; ++begin, fileIndex++) {
+		const FileManifestHeader &file = *begin;
+		boost::string_view parentPath, name;
+
+		splitPath(file.path, parentPath, name);
+
+		uint32_t node = addNode(names.intern(name), (uint8_t) file.fileType);
+
+		nodes[node].fileIndex = fileIndex;
+		nodes[node].deleted = file.version.isDeleted();
+		nodes[node].sourceLength = file.version.sourceLength;
+
+		fileIds.emplace(TreeFileId(file.fileId), node);
+		pending.push_back(PendingFile{node, TreeFileId(file.parentFileId), directoryPaths.intern(parentPath)});
+
+		if (nodes[node].isDirectory()) {
+			uint32_t &existing = directoryNode(directoryPaths.intern(file.path));
+
+			if (existing == NO_NODE) {
+				existing = node;
+			}
+		}
+	}
+
+	// Find (or create) the node for a directory which has no record of its own in the manifest:
+	std::function<uint32_t(uint32_t)> impliedDirectory = [&](uint32_t path) -> uint32_t {
+		uint32_t found = directoryNode(path);
+
+		if (found != NO_NODE) {
+			return found;
+		}
+
+		boost::string_view parentPath, name;
+
+		splitPath(directoryPaths.get(path), parentPath, name);
+
+		uint32_t node = addNode(names.intern(name), FILE_TYPE_DIRECTORY);
+		uint32_t parent = impliedDirectory(directoryPaths.intern(parentPath));
+
+		nodes[node].parent = parent;
+		directoryNode(path) = node;
+
+		return node;
+	};
+
+	for (auto &file : pending) {
+		auto parent = fileIds.find(file.parentFileId);
+
+		if (parent != fileIds.end() && parent->second != file.node) {
+			nodes[file.node].parent = parent->second;
+		} else {
+			// (This can add nodes, so don't hold a reference to the node across the call)
+			uint32_t implied = impliedDirectory(file.parentPath);
+
+			nodes[file.node].parent = implied;
+		}
+	}
+
+	std::vector<PendingFile>().swap(pending);
+	fileIds.clear();
+
+	// A damaged manifest could have parent IDs which form a cycle, break those by moving the cycle to the root:
+	std::vector<uint8_t> state(nodes.size(), 0);
+	std::vector<uint32_t> ancestors;
+
+	const uint8_t VISITING = 1, VISITED = 2;
+
+	state[ROOT] = VISITED;
+
+	for (uint32_t i = 0; i < nodes.size(); i++) {
+		uint32_t node = i;
+
+		while (state[node] == 0) {
+			state[node] = VISITING;
+			ancestors.push_back(node);
+			node = nodes[node].parent;
+		}
+
+		if (state[node] == VISITING) {
+			nodes[ancestors.back()].parent = ROOT;
+		}
+
+		for (uint32_t ancestor : ancestors) {
+			state[ancestor] = VISITED;
+		}
+
+		ancestors.clear();
+	}
+
+	linkChildren();
+
+	names.freeze();
+}
+
+void DirectoryTree::linkChildren() {
+	for (uint32_t i = 1; i < nodes.size(); i++) {
+		nodes[nodes[i].parent].childCount++;
+	}
+
+	uint32_t firstChild = 0;
+
+	for (auto &node : nodes) {
+		node.firstChild = firstChild;
+		firstChild += node.childCount;
+		node.childCount = 0;
+	}
+
+	children.resize(firstChild);
+
+	for (uint32_t i = 1; i < nodes.size(); i++) {
+		DirectoryTreeNode &parent = nodes[nodes[i].parent];
+
+		children[parent.firstChild + parent.childCount++] = i;
+	}
+
+	for (auto &node : nodes) {
+		std::sort(children.begin() + node.firstChild, children.begin() + node.firstChild + node.childCount,
+			[this](uint32_t a, uint32_t b) {
+				int comparison = getName(a).compare(getName(b));
+
+				return comparison < 0 || (comparison == 0 && a < b);
+			}
+		);
+	}
+}
+
+std::string DirectoryTree::getPath(uint32_t node) const {
+	std::vector<uint32_t> ancestors;
+
+	for (; node != ROOT; node = nodes[node].parent) {
+		ancestors.push_back(node);
+	}
+
+	std::string result;
+
+	for (auto it = ancestors.rbegin(); it != ancestors.rend(); ++it) {
+		if (!result.empty() && result.back() != '/') {
+			result += '/';
+		}
+
+		boost::string_view name = getName(*it);
+
+		result.append(name.data(), name.length());
+	}
+
+	return result;
+}
+
+bool DirectoryTree::findPath(const std::string &path, uint32_t &node) const {
+	boost::string_view remaining(path);
+
+	node = ROOT;
+
+	while (!remaining.empty()) {
+		boost::string_view component;
+
+		if (node == ROOT && remaining[0] == '/') {
+			component = remaining.substr(0, 1);
+			remaining.remove_prefix(1);
+		} else {
+			size_t separator = remaining.find('/');
+
+			component = remaining.substr(0, separator);
+			remaining.remove_prefix(separator == boost::string_view::npos ? remaining.length() : separator + 1);
+
+			if (component.empty()) {
+				continue;
+			}
+		}
+
+		const DirectoryTreeNode &parent = nodes[node];
+		auto first = children.begin() + parent.firstChild, last = first + parent.childCount;
+
+		auto found = std::lower_bound(first, last, component, [this](uint32_t child, boost::string_view name) {
+			return getName(child) < name;
+		});
+
+		if (found == last || getName(*found) != component) {
+			return false;
+		}
+
+		node = *found;
+	}
+
+	return true;
+}
+
+std::vector<DirectoryTreeTotals> DirectoryTree::getTotals(bool includeDeleted) const {
+	std::vector<DirectoryTreeTotals> totals(nodes.size(), DirectoryTreeTotals{0, 0});
+
+	// Visit parents before their children, then add up the totals in the reverse of that order:
+	std::vector<uint32_t> order;
+
+	order.reserve(nodes.size());
+	order.push_back(ROOT);
+
+	for (size_t i = 0; i < order.size(); i++) {
+		const DirectoryTreeNode &node = nodes[order[i]];
+
+		for (uint32_t j = 0; j < node.childCount; j++) {
+			order.push_back(children[node.firstChild + j]);
+		}
+	}
+
+	for (auto it = order.rbegin(); it != order.rend(); ++it) {
+		const DirectoryTreeNode &node = nodes[*it];
+		DirectoryTreeTotals &total = totals[*it];
+
+		if (node.fileIndex != NO_FILE && !node.isDirectory() && (includeDeleted || !node.deleted)) {
+			total.files++;
+			total.bytes += node.sourceLength;
+		}
+
+		if (*it != ROOT) {
+			totals[node.parent].files += total.files;
+			totals[node.parent].bytes += total.bytes;
+		}
+	}
+
+	return totals;
+}
@@ -0,0 +1,123 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "boost/utility/string_view.hpp"
+
+#include "backup.h"
+
+/**
+ * Stores each distinct string once, identified by a number.
+ */
+class StringPool {
+private:
+	std::string data;
+	std::vector<uint64_t> offsets;
+
+	// Only needed while strings are being added:
+	std::unordered_map<std::string, uint32_t> ids;
+
+public:
+	StringPool() : offsets{0} {
+	}
+
+	uint32_t intern(boost::string_view s);
+
+	boost::string_view get(uint32_t id) const {
+		return boost::string_view(data.data() + offsets[id], offsets[id + 1] - offsets[id]);
+	}
+
+	size_t size() const {
+		return offsets.size() - 1;
+	}
+
+	/**
+	 * Release the memory used to find existing strings, after which intern() must not be called again.
+	 */
+	void freeze();
+};
+
+class DirectoryTreeNode {
+public:
+	uint32_t parent;
+	uint32_t name;
+
+	// This node's children are children[firstChild .. firstChild + childCount), sorted by name:
+	uint32_t firstChild, childCount;
+
+	// Position of the file in the file manifest, or DirectoryTree::NO_FILE for directories that are only implied by
+	// the paths of the files inside them:
+	uint32_t fileIndex;
+
+	// From the newest revision:
+	uint8_t fileType;
+	bool deleted;
+	int64_t sourceLength;
+
+	bool isDirectory() const {
+		return fileType == FILE_TYPE_DIRECTORY;
+	}
+};
+
+class DirectoryTreeTotals {
+public:
+	uint64_t files;
+	uint64_t bytes;
+};
+
+/**
+ * The directory hierarchy of the files in the file manifest, built from each file's ID and its parent's ID. Directories
+ * that don't have records of their own in the manifest are filled in from the paths of the files inside them.
+ *
+ * Nodes store their own name as a component interned in a string pool rather than a full path, and their children as
+ * a range of a shared, name-sorted array, so the tree takes a few dozen bytes per file.
+ */
+class DirectoryTree {
+private:
+	std::vector<DirectoryTreeNode> nodes;
+	std::vector<uint32_t> children;
+	StringPool names;
+
+	uint32_t addNode(uint32_t name, uint8_t fileType);
+	void linkChildren();
+
+public:
+	static const uint32_t ROOT = 0;
+	static const uint32_t NO_FILE = UINT32_MAX;
+
+	explicit DirectoryTree(BackupArchive &archive);
+
+	size_t size() const {
+		return nodes.size();
+	}
+
+	const DirectoryTreeNode& getNode(uint32_t node) const {
+		return nodes[node];
+	}
+
+	boost::string_view getName(uint32_t node) const {
+		return names.get(nodes[node].name);
+	}
+
+	uint32_t getChild(uint32_t node, uint32_t index) const {
+		return children[nodes[node].firstChild + index];
+	}
+
+	/**
+	 * Rebuild the full path of the node from its ancestors' names.
+	 */
+	std::string getPath(uint32_t node) const;
+
+	/**
+	 * Find the node for the given path (a trailing separator is ignored), returning false if it isn't in the tree.
+	 */
+	bool findPath(const std::string &path, uint32_t &node) const;
+
+	/**
+	 * Count the files in each node's subtree (including the node itself) and add up the newest size of each.
+	 */
+	std::vector<DirectoryTreeTotals> getTotals(bool includeDeleted) const;
+};
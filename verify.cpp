@@ -0,0 +1,87 @@
+#include <algorithm>
+#include <cstring>
+
+#define CRYPTOPP_ENABLE_NAMESPACE_WEAK 1
+#include "cryptopp/md5.h"
+
+#include "verify.h"
+#include "restore.h"
+
+static bool checkMD5(CryptoPP::Weak::MD5 &hasher, boost::string_view data, const CryptoPP::byte *expected) {
+	CryptoPP::byte hash[CryptoPP::Weak::MD5::DIGESTSIZE];
+
+	hasher.Update((const CryptoPP::byte*) data.data(), data.length());
+	hasher.Final(hash);
+
+	return memcmp(hash, expected, sizeof(hash)) == 0;
+}
+
+BlockVerifyResult verifyBlockDirectory(const BlockDirectories &directories, const BlockManifest &manifest, const std::string &key) {
+	BlockVerifyResult result;
+	std::vector<int64_t> blocks;
+
+	try {
+		blocks = manifest.getBlocksInStorageOrder();
+	} catch (std::exception &e) {
+		result.directoryError = std::string("Failed to load block manifest: ") + e.what();
+		return result;
+	}
+
+	// Since the blocks are in storage order, the reader turns this into a sequential scan of the data file
+	BlockReader reader(directories, blocks);
+	BlockDecoder decoder(key);
+	CryptoPP::Weak::MD5 hasher;
+
+	/* Let the OS read ahead as the scan goes rather than asking for the whole data file up front, which could be many
+	 * gigabytes (for each of the workers) and would push the parts not scanned yet back out of the page cache.
+	 * Hints are best-effort, so a missing data file is left for read() to report.
+	 */
+	try {
+		manifest.openDataFile()->adviseSequential();
+	} catch (std::exception &e) {
+	}
+
+	for (size_t i = 0; i < blocks.size(); i++) {
+		std::string problem;
+
+		try {
+			boost::string_view archivedData, plaintext;
+			DataBlock block = reader.read(i, archivedData);
+
+			if (key.length() > 0) {
+				switch (decoder.decode(block, archivedData, plaintext)) {
+					case BlockDecodeStatus::badArchivedMD5:
+						problem = "archived data doesn't match backupMD5";
+						break;
+					case BlockDecodeStatus::badSourceMD5:
+						problem = "decoded data doesn't match sourceMD5";
+						break;
+					case BlockDecodeStatus::ok:
+						break;
+				}
+			} else if (block.isEncrypted() || block.isCompressed()) {
+				if (!checkMD5(hasher, archivedData, block.backupMD5)) {
+					problem = "archived data doesn't match backupMD5";
+				}
+			} else if (!checkMD5(hasher, archivedData, block.sourceMD5)) {
+				problem = "archived data doesn't match sourceMD5";
+			}
+		} catch (std::exception &e) {
+			problem = e.what();
+		}
+
+		if (!problem.empty()) {
+			result.corruptBlocks.push_back(CorruptBlock{blocks[i], problem});
+		}
+
+		result.blocksChecked++;
+	}
+
+	std::sort(result.corruptBlocks.begin(), result.corruptBlocks.end(),
+		[](const CorruptBlock &a, const CorruptBlock &b) {
+			return a.blockNumber < b.blockNumber;
+		}
+	);
+
+	return result;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "blocks.h"
+
+class CorruptBlock {
+public:
+	int64_t blockNumber;
+	std::string problem;
+};
+
+class BlockVerifyResult {
+public:
+	uint64_t blocksChecked;
+	std::vector<CorruptBlock> corruptBlocks;
+
+	// Set if the directory couldn't be checked at all (e.g. its manifest couldn't be loaded):
+	std::string directoryError;
+
+	BlockVerifyResult() : blocksChecked(0) {
+	}
+};
+
+/**
+ * Check every live block in a block directory, reading its block data file from start to end.
+ *
+ * Every block's archived data is checked against its backupMD5. If a key is given, the blocks are also decrypted and
+ * decompressed so the result can be checked against their sourceMD5 (without a key, only unencrypted and uncompressed
+ * blocks have their sourceMD5 checked).
+ */
+BlockVerifyResult verifyBlockDirectory(const BlockDirectories &directories, const BlockManifest &manifest, const std::string &key);